@@ -0,0 +1,624 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// The allocator's header renames the standard functions, which would hide glibc's
+#include "../malloc.h"
+#undef malloc
+#undef realloc
+#undef calloc
+#undef free
+#undef aligned_alloc
+#undef posix_memalign
+#undef memalign
+
+// Every benchmark runs in its own child process for every allocator, so that the peak RSS reported
+// by wait4 belongs to just that run and one allocator's leftovers can't affect the next
+#define NUM_THREADS 4
+#define MAX_SAMPLES ((size_t) 1 << 20)
+
+typedef struct allocator {
+  const char *name;
+  void *(*malloc)(size_t);
+  void (*free)(void *);
+  void *(*realloc)(void *, size_t);
+} allocator_t;
+
+typedef struct result {
+  double ops_per_sec;
+  double p50;
+  double p99;
+  double p999;
+  // Peak RSS divided by the bytes that were live at the peak, only set by the fragmentation test
+  double rss_ratio;
+} result_t;
+
+typedef struct benchmark {
+  const char *name;
+  void (*run)(result_t *);
+} benchmark_t;
+
+// Latencies of single operations in nanoseconds. Only every stride'th operation is timed so that
+// long runs don't need huge buffers
+typedef struct samples {
+  uint32_t *ns;
+  size_t n;
+  size_t stride;
+  size_t count;
+} samples_t;
+
+allocator_t allocators[4];
+size_t num_allocators = 0;
+
+// The allocator being benchmarked in this process
+allocator_t *alloc;
+
+// Everything runs scale times fewer iterations than the defaults
+size_t scale = 1;
+
+// Get the current time in nanoseconds
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+// Get the next number from a xorshift generator
+uint64_t next_random(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+// Get a random size between min and max bytes that favors small sizes the way real programs do,
+// by picking a random power of two range first and then a size inside of it
+size_t random_size(uint64_t *state, size_t min, size_t max) {
+  size_t ranges = 1;
+  while ((min << ranges) <= max) {
+    ranges++;
+  }
+  size_t low = min << (next_random(state) % ranges);
+  size_t size = low + (size_t) (next_random(state) % low);
+  return size < max ? size : max;
+}
+
+// Map memory for the benchmark's own bookkeeping, which shouldn't come from the allocator under
+// test
+void *map(size_t size) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return p;
+}
+
+// Set up a sample buffer for a run of about ops operations
+void samples_init(samples_t *s, size_t ops) {
+  s->ns = map(MAX_SAMPLES * sizeof(uint32_t));
+  s->n = 0;
+  s->stride = ops / MAX_SAMPLES + 1;
+  s->count = 0;
+}
+
+// Return true if the next operation should be timed
+bool samples_due(samples_t *s) {
+  return s->count++ % s->stride == 0 && s->n < MAX_SAMPLES;
+}
+
+void samples_add(samples_t *s, uint64_t ns) {
+  s->ns[s->n++] = ns > UINT32_MAX ? UINT32_MAX : (uint32_t) ns;
+}
+
+int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a;
+  uint32_t y = *(const uint32_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+// Fill in the result's percentiles from the samples of every thread
+void samples_finish(samples_t *s, size_t count, result_t *r) {
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++) {
+    total += s[i].n;
+  }
+  if (total == 0) {
+    return;
+  }
+  uint32_t *all = map(total * sizeof(uint32_t));
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++) {
+    memcpy(all + n, s[i].ns, s[i].n * sizeof(uint32_t));
+    n += s[i].n;
+  }
+  qsort(all, total, sizeof(uint32_t), compare_u32);
+  r->p50 = all[total / 2];
+  r->p99 = all[total * 99 / 100];
+  r->p999 = all[total * 999 / 1000];
+}
+
+// Run fn on NUM_THREADS threads, giving each its index, and wait for all of them
+void run_threads(void *(*fn)(void *)) {
+  pthread_t threads[NUM_THREADS];
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    pthread_create(&threads[i], NULL, fn, (void *) i);
+  }
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+// malloc/free pairs of a single size on one thread. Every block is touched so that the allocator
+// can't get away with handing out memory that is never backed
+void run_pairs(result_t *r, size_t size, size_t ops) {
+  ops /= scale;
+  samples_t s;
+  samples_init(&s, ops);
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < ops; i++) {
+    bool timed = samples_due(&s);
+    uint64_t t = timed ? now_ns() : 0;
+    char *p = alloc->malloc(size);
+    *(volatile char *) p = 1;
+    alloc->free(p);
+    if (timed) {
+      samples_add(&s, now_ns() - t);
+    }
+  }
+  r->ops_per_sec = (double) ops * 1e9 / (double) (now_ns() - start);
+  samples_finish(&s, 1, r);
+}
+
+void bench_pairs_16(result_t *r) {
+  run_pairs(r, 16, 4000000);
+}
+
+void bench_pairs_64(result_t *r) {
+  run_pairs(r, 64, 4000000);
+}
+
+void bench_pairs_256(result_t *r) {
+  run_pairs(r, 256, 4000000);
+}
+
+void bench_pairs_1k(result_t *r) {
+  run_pairs(r, 1024, 2000000);
+}
+
+void bench_pairs_4k(result_t *r) {
+  run_pairs(r, 4096, 1000000);
+}
+
+void bench_pairs_64k(result_t *r) {
+  run_pairs(r, 65536, 200000);
+}
+
+void bench_pairs_256k(result_t *r) {
+  run_pairs(r, 262144, 20000);
+}
+
+// Producers allocate blocks and hand them to consumers through single producer single consumer
+// rings, so every block is freed by a different thread than the one that allocated it
+#define RING_SIZE 1024
+#define PRODCONS_OPS 1000000
+
+typedef struct ring {
+  _Alignas(64) atomic_size_t head;
+  _Alignas(64) atomic_size_t tail;
+  void *slots[RING_SIZE];
+} ring_t;
+
+ring_t *rings;
+samples_t prodcons_samples[NUM_THREADS];
+
+void *prodcons_thread(void *arg) {
+  size_t index = (size_t) arg;
+  ring_t *ring = &rings[index / 2];
+  samples_t *s = &prodcons_samples[index];
+  size_t ops = PRODCONS_OPS / scale;
+  uint64_t state = index * 0x9E3779B97F4A7C15 + 1;
+  for (size_t i = 0; i < ops; i++) {
+    if (index % 2 == 0) {
+      size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+      while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == RING_SIZE) {
+        sched_yield();
+      }
+      bool timed = samples_due(s);
+      uint64_t t = timed ? now_ns() : 0;
+      char *p = alloc->malloc(random_size(&state, 16, 512));
+      if (timed) {
+        samples_add(s, now_ns() - t);
+      }
+      *p = 1;
+      ring->slots[head % RING_SIZE] = p;
+      atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    } else {
+      size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+      while (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+        sched_yield();
+      }
+      void *p = ring->slots[tail % RING_SIZE];
+      atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+      bool timed = samples_due(s);
+      uint64_t t = timed ? now_ns() : 0;
+      alloc->free(p);
+      if (timed) {
+        samples_add(s, now_ns() - t);
+      }
+    }
+  }
+  return NULL;
+}
+
+void bench_prodcons(result_t *r) {
+  rings = map(NUM_THREADS / 2 * sizeof(ring_t));
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    samples_init(&prodcons_samples[i], PRODCONS_OPS / scale);
+  }
+  uint64_t start = now_ns();
+  run_threads(prodcons_thread);
+  r->ops_per_sec =
+      (double) (PRODCONS_OPS / scale * NUM_THREADS) * 1e9 / (double) (now_ns() - start);
+  samples_finish(prodcons_samples, NUM_THREADS, r);
+}
+
+// Many string builders growing at the same time by appending a little at a time, so the
+// allocator either grows them in place or has to copy them
+#define REALLOC_BUILDERS 64
+#define REALLOC_MAX ((size_t) 256 << 10)
+
+void bench_realloc(result_t *r) {
+  size_t rounds = 40 / scale + 1;
+  char *builders[REALLOC_BUILDERS] = {0};
+  size_t lengths[REALLOC_BUILDERS] = {0};
+  samples_t s;
+  samples_init(&s, rounds * REALLOC_BUILDERS * (REALLOC_MAX / 64));
+  uint64_t state = 42;
+  size_t ops = 0;
+  uint64_t start = now_ns();
+  for (size_t round = 0; round < rounds; round++) {
+    for (size_t step = 0; step < REALLOC_MAX / 64; step++) {
+      for (size_t b = 0; b < REALLOC_BUILDERS; b++) {
+        size_t len = lengths[b] + 1 + (size_t) (next_random(&state) % 127);
+        if (len > REALLOC_MAX) {
+          continue;
+        }
+        bool timed = samples_due(&s);
+        uint64_t t = timed ? now_ns() : 0;
+        builders[b] = alloc->realloc(builders[b], len);
+        if (timed) {
+          samples_add(&s, now_ns() - t);
+        }
+        builders[b][len - 1] = 1;
+        lengths[b] = len;
+        ops++;
+      }
+    }
+    for (size_t b = 0; b < REALLOC_BUILDERS; b++) {
+      alloc->free(builders[b]);
+      builders[b] = NULL;
+      lengths[b] = 0;
+    }
+  }
+  r->ops_per_sec = (double) ops * 1e9 / (double) (now_ns() - start);
+  samples_finish(&s, 1, r);
+}
+
+// Larson: every thread keeps a set of live blocks and keeps replacing random ones with new blocks
+// of random sizes. After every round each thread's blocks are handed to the thread of the next
+// round, which frees them, the same way a server hands connections between worker threads
+#define LARSON_SLOTS 1000
+#define LARSON_OPS 400000
+#define LARSON_ROUNDS 4
+
+void *larson_slots[NUM_THREADS][LARSON_SLOTS];
+samples_t larson_samples[NUM_THREADS];
+
+void *larson_thread(void *arg) {
+  size_t index = (size_t) arg;
+  void **slots = larson_slots[index];
+  samples_t *s = &larson_samples[index];
+  uint64_t state = index * 0x9E3779B97F4A7C15 + now_ns();
+  for (size_t i = 0; i < LARSON_OPS / scale; i++) {
+    size_t slot = (size_t) (next_random(&state) % LARSON_SLOTS);
+    bool timed = samples_due(s);
+    uint64_t t = timed ? now_ns() : 0;
+    alloc->free(slots[slot]);
+    slots[slot] = alloc->malloc(random_size(&state, 16, 1024));
+    if (timed) {
+      samples_add(s, now_ns() - t);
+    }
+    *(char *) slots[slot] = 1;
+  }
+  return NULL;
+}
+
+void bench_larson(result_t *r) {
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    samples_init(&larson_samples[i], LARSON_OPS / scale * LARSON_ROUNDS);
+  }
+  uint64_t start = now_ns();
+  for (size_t round = 0; round < LARSON_ROUNDS; round++) {
+    run_threads(larson_thread);
+  }
+  uint64_t elapsed = now_ns() - start;
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    for (size_t j = 0; j < LARSON_SLOTS; j++) {
+      alloc->free(larson_slots[i][j]);
+    }
+  }
+  r->ops_per_sec = (double) (LARSON_OPS / scale * NUM_THREADS * LARSON_ROUNDS) * 1e9 /
+      (double) elapsed;
+  samples_finish(larson_samples, NUM_THREADS, r);
+}
+
+// xmalloc: threads allocate batches of blocks and put them on a shared stack, then take whichever
+// batch is on top and free it, so blocks end up being freed by any thread
+#define XMALLOC_BATCH 64
+#define XMALLOC_BATCHES 40000
+
+typedef struct batch {
+  struct batch *next;
+  void *blocks[XMALLOC_BATCH];
+} batch_t;
+
+batch_t *xmalloc_stack = NULL;
+batch_t *xmalloc_batches;
+pthread_mutex_t xmalloc_lock = PTHREAD_MUTEX_INITIALIZER;
+samples_t xmalloc_samples[NUM_THREADS];
+
+void *xmalloc_thread(void *arg) {
+  size_t index = (size_t) arg;
+  samples_t *s = &xmalloc_samples[index];
+  uint64_t state = index * 0x9E3779B97F4A7C15 + 7;
+  size_t batches = XMALLOC_BATCHES / scale;
+  for (size_t i = 0; i < batches; i++) {
+    batch_t *batch = &xmalloc_batches[index * batches + i];
+    for (size_t j = 0; j < XMALLOC_BATCH; j++) {
+      bool timed = samples_due(s);
+      uint64_t t = timed ? now_ns() : 0;
+      batch->blocks[j] = alloc->malloc(random_size(&state, 16, 256));
+      if (timed) {
+        samples_add(s, now_ns() - t);
+      }
+      *(char *) batch->blocks[j] = 1;
+    }
+    pthread_mutex_lock(&xmalloc_lock);
+    batch_t *victim = xmalloc_stack;
+    if (victim != NULL) {
+      xmalloc_stack = victim->next;
+    }
+    batch->next = xmalloc_stack;
+    xmalloc_stack = batch;
+    pthread_mutex_unlock(&xmalloc_lock);
+    if (victim != NULL) {
+      for (size_t j = 0; j < XMALLOC_BATCH; j++) {
+        alloc->free(victim->blocks[j]);
+      }
+    }
+  }
+  return NULL;
+}
+
+void bench_xmalloc(result_t *r) {
+  size_t batches = XMALLOC_BATCHES / scale;
+  xmalloc_batches = map(NUM_THREADS * batches * sizeof(batch_t));
+  xmalloc_stack = NULL;
+  for (size_t i = 0; i < NUM_THREADS; i++) {
+    samples_init(&xmalloc_samples[i], batches * XMALLOC_BATCH);
+  }
+  uint64_t start = now_ns();
+  run_threads(xmalloc_thread);
+  uint64_t elapsed = now_ns() - start;
+  for (batch_t *batch = xmalloc_stack; batch != NULL; batch = batch->next) {
+    for (size_t j = 0; j < XMALLOC_BATCH; j++) {
+      alloc->free(batch->blocks[j]);
+    }
+  }
+  r->ops_per_sec = (double) (batches * XMALLOC_BATCH * NUM_THREADS) * 1e9 / (double) elapsed;
+  samples_finish(xmalloc_samples, NUM_THREADS, r);
+}
+
+// Fragmentation over time: phases of filling the heap up with random sizes and freeing a random
+// half of it, with the live data growing over time. The peak RSS is compared to the most bytes
+// that were ever live, so an allocator that can't reuse its holes shows up with a high ratio
+#define FRAG_SLOTS 100000
+#define FRAG_PHASES 20
+
+void bench_frag(result_t *r) {
+  void **slots = map(FRAG_SLOTS * sizeof(void *));
+  size_t *sizes = map(FRAG_SLOTS * sizeof(size_t));
+  size_t phases = FRAG_PHASES / scale + 1;
+  uint64_t state = 1234;
+  size_t live = 0;
+  size_t peak_live = 0;
+  size_t ops = 0;
+  samples_t s;
+  samples_init(&s, phases * FRAG_SLOTS);
+  uint64_t start = now_ns();
+  for (size_t phase = 0; phase < phases; phase++) {
+    size_t max_size = (size_t) 64 << (phase % 8);
+    for (size_t i = 0; i < FRAG_SLOTS; i++) {
+      if (slots[i] != NULL) {
+        continue;
+      }
+      sizes[i] = random_size(&state, 8, max_size);
+      bool timed = samples_due(&s);
+      uint64_t t = timed ? now_ns() : 0;
+      slots[i] = alloc->malloc(sizes[i]);
+      if (timed) {
+        samples_add(&s, now_ns() - t);
+      }
+      memset(slots[i], 1, sizes[i] < 64 ? sizes[i] : 64);
+      live += sizes[i];
+      ops++;
+    }
+    if (live > peak_live) {
+      peak_live = live;
+    }
+    for (size_t i = 0; i < FRAG_SLOTS; i++) {
+      if (next_random(&state) % 2 == 0) {
+        alloc->free(slots[i]);
+        slots[i] = NULL;
+        live -= sizes[i];
+        ops++;
+      }
+    }
+  }
+  r->ops_per_sec = (double) ops * 1e9 / (double) (now_ns() - start);
+  samples_finish(&s, 1, r);
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  r->rss_ratio = (double) usage.ru_maxrss * 1024 / (double) peak_live;
+}
+
+benchmark_t benchmarks[] = {
+  {"pairs-16", bench_pairs_16},
+  {"pairs-64", bench_pairs_64},
+  {"pairs-256", bench_pairs_256},
+  {"pairs-1k", bench_pairs_1k},
+  {"pairs-4k", bench_pairs_4k},
+  {"pairs-64k", bench_pairs_64k},
+  {"pairs-256k", bench_pairs_256k},
+  {"prodcons", bench_prodcons},
+  {"realloc", bench_realloc},
+  {"larson", bench_larson},
+  {"xmalloc", bench_xmalloc},
+  {"frag", bench_frag},
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+// Add another allocator from a shared library if it is installed. It is loaded with its symbols
+// kept local so that it only serves the calls made through its table entry
+void add_library(const char *name, const char *file, const char *prefix) {
+  void *handle = dlopen(file, RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL) {
+    return;
+  }
+  char symbol[64];
+  allocator_t *a = &allocators[num_allocators];
+  snprintf(symbol, sizeof(symbol), "%smalloc", prefix);
+  a->malloc = (void *(*)(size_t)) dlsym(handle, symbol);
+  snprintf(symbol, sizeof(symbol), "%sfree", prefix);
+  a->free = (void (*)(void *)) dlsym(handle, symbol);
+  snprintf(symbol, sizeof(symbol), "%srealloc", prefix);
+  a->realloc = (void *(*)(void *, size_t)) dlsym(handle, symbol);
+  if (a->malloc == NULL || a->free == NULL || a->realloc == NULL) {
+    dlclose(handle);
+    return;
+  }
+  a->name = name;
+  num_allocators++;
+}
+
+// Run a benchmark with an allocator in a child process and print its results
+void run(benchmark_t *b, allocator_t *a) {
+  int fds[2];
+  if (pipe(fds) == -1) {
+    perror("pipe");
+    exit(1);
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    alloc = a;
+    result_t r = {0};
+    b->run(&r);
+    if (write(fds[1], &r, sizeof(r)) != sizeof(r)) {
+      _exit(1);
+    }
+    _exit(0);
+  }
+  close(fds[1]);
+  result_t r;
+  ssize_t n = read(fds[0], &r, sizeof(r));
+  close(fds[0]);
+  int status;
+  struct rusage usage;
+  wait4(pid, &status, 0, &usage);
+  if (n != sizeof(r) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    printf("%-12s %-10s failed\n", b->name, a->name);
+    return;
+  }
+  printf("%-12s %-10s %14.0f %10.0f %10.0f %10.0f %12ld", b->name, a->name, r.ops_per_sec, r.p50,
+      r.p99, r.p999, usage.ru_maxrss);
+  if (r.rss_ratio != 0) {
+    printf(" %10.2f", r.rss_ratio);
+  }
+  printf("\n");
+}
+
+void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-a allocator] [-b benchmark] [-s scale]\n", prog);
+  fprintf(stderr, "  -a  only run the allocator with this name\n");
+  fprintf(stderr, "  -b  only run the benchmark with this name\n");
+  fprintf(stderr, "  -s  run scale times fewer iterations\n");
+}
+
+int main(int argc, char **argv) {
+  const char *only_allocator = NULL;
+  const char *only_benchmark = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "a:b:s:h")) != -1) {
+    switch (opt) {
+      case 'a':
+        only_allocator = optarg;
+        break;
+      case 'b':
+        only_benchmark = optarg;
+        break;
+      case 's':
+        scale = strtoul(optarg, NULL, 10);
+        if (scale == 0) {
+          scale = 1;
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  allocators[num_allocators++] =
+      (allocator_t) {"custom", custom_malloc, custom_free, custom_realloc};
+  allocators[num_allocators++] = (allocator_t) {"glibc", malloc, free, realloc};
+  add_library("jemalloc", "libjemalloc.so.2", "");
+  add_library("mimalloc", "libmimalloc.so.2", "mi_");
+
+  printf("%-12s %-10s %14s %10s %10s %10s %12s %10s\n", "benchmark", "allocator", "ops/sec",
+      "p50 ns", "p99 ns", "p99.9 ns", "peak RSS KiB", "RSS/live");
+  for (size_t i = 0; i < NUM_BENCHMARKS; i++) {
+    if (only_benchmark != NULL && strcmp(only_benchmark, benchmarks[i].name) != 0) {
+      continue;
+    }
+    for (size_t j = 0; j < num_allocators; j++) {
+      if (only_allocator != NULL && strcmp(only_allocator, allocators[j].name) != 0) {
+        continue;
+      }
+      run(&benchmarks[i], &allocators[j]);
+    }
+  }
+  return 0;
+}
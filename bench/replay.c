@@ -0,0 +1,435 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// The allocator's header renames the standard functions, which would hide glibc's
+#include "../malloc.h"
+#undef malloc
+#undef realloc
+#undef calloc
+#undef free
+#undef aligned_alloc
+#undef posix_memalign
+#undef memalign
+
+// Replays a trace recorded with CUSTOM_MALLOC_TRACE against every allocator that is installed, and
+// reports how long the calls took, the peak RSS, and the peak RSS over the most bytes that the
+// trace ever had live. The records are put in order by time and replayed on a single thread, with
+// the addresses in the trace turned into dense ids up front so that the replay itself only indexes
+// an array. Every run happens in its own child process like in bench, so that the peak RSS
+// reported by wait4 belongs to just that run
+#define NO_ID UINT32_MAX
+
+typedef struct allocator {
+  const char *name;
+  void *(*malloc)(size_t);
+  void *(*calloc)(size_t, size_t);
+  void *(*realloc)(void *, size_t);
+  void (*free)(void *);
+  void *(*aligned_alloc)(size_t, size_t);
+} allocator_t;
+
+// A call of the trace, with the allocation that it takes and the one that it makes as ids. The
+// allocation that an allocating call takes is one that the trace lost track of (see load_trace)
+typedef struct call {
+  uint64_t time;
+  uint64_t size;
+  uint32_t index;
+  uint32_t in;
+  uint32_t out;
+  uint16_t op;
+  uint16_t alignment_shift;
+} call_t;
+
+// What a run sends back to the parent
+typedef struct result {
+  uint64_t ns;
+  long base_rss;
+} result_t;
+
+// An entry of the table of addresses that are live at a point in the trace
+typedef struct live {
+  uint64_t address;
+  uint32_t id;
+} live_t;
+
+allocator_t allocators[4];
+size_t num_allocators = 0;
+
+call_t *calls;
+size_t num_calls = 0;
+size_t num_ids = 0;
+size_t num_threads = 0;
+size_t peak_live = 0;
+size_t skipped = 0;
+
+live_t *live_table;
+size_t live_capacity = 0;
+size_t live_count = 0;
+
+// Get the current time in nanoseconds
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+// Map memory for the replay's own bookkeeping, which shouldn't come from the allocator under test
+void *map(size_t size) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return p;
+}
+
+// Get the slot of the live table that the given address hashes to
+size_t live_home(uint64_t address) {
+  return (size_t) ((address >> 4) * UINT64_C(0x9E3779B97F4A7C15) >> 32) & (live_capacity - 1);
+}
+
+// Get the slot of the live table that holds the given address, or the empty slot where it would go
+size_t live_slot(uint64_t address) {
+  size_t i = live_home(address);
+  while (live_table[i].address != 0 && live_table[i].address != address) {
+    i = (i + 1) & (live_capacity - 1);
+  }
+  return i;
+}
+
+// Add an address to the live table, doubling the table once it is half full
+void live_put(uint64_t address, uint32_t id) {
+  if ((live_count + 1) * 2 > live_capacity) {
+    live_t *old = live_table;
+    size_t old_capacity = live_capacity;
+    live_capacity = old_capacity != 0 ? old_capacity * 2 : 4096;
+    live_table = map(live_capacity * sizeof(live_t));
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old[i].address != 0) {
+        live_table[live_slot(old[i].address)] = old[i];
+      }
+    }
+    if (old != NULL) {
+      munmap(old, old_capacity * sizeof(live_t));
+    }
+  }
+  size_t i = live_slot(address);
+  if (live_table[i].address == 0) {
+    live_count++;
+  }
+  live_table[i] = (live_t) {address, id};
+}
+
+// Take an address out of the live table and return its id, or NO_ID if it isn't live. The entries
+// after it are shifted back so that lookups never have to step over holes
+uint32_t live_take(uint64_t address) {
+  if (live_capacity == 0) {
+    return NO_ID;
+  }
+  size_t i = live_slot(address);
+  if (live_table[i].address == 0) {
+    return NO_ID;
+  }
+  uint32_t id = live_table[i].id;
+  size_t hole = i;
+  for (size_t j = (i + 1) & (live_capacity - 1); live_table[j].address != 0;
+      j = (j + 1) & (live_capacity - 1)) {
+    size_t home = live_home(live_table[j].address);
+    // An entry can fill the hole if its home slot isn't between the hole and the entry
+    if ((j > hole && (home <= hole || home > j)) || (j < hole && home <= hole && home > j)) {
+      live_table[hole] = live_table[j];
+      live_table[j].address = 0;
+      hole = j;
+    }
+  }
+  live_table[hole].address = 0;
+  live_count--;
+  return id;
+}
+
+int compare_calls(const void *a, const void *b) {
+  const call_t *x = a;
+  const call_t *y = b;
+  if (x->time != y->time) {
+    return x->time < y->time ? -1 : 1;
+  }
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Read a trace file and turn it into calls in order of time, numbering every allocation that the
+// trace makes. Frees and reallocations of addresses that the trace never saw being allocated, like
+// ones from before tracing started, can't be replayed and are skipped
+void load_trace(const char *path) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror(path);
+    exit(1);
+  }
+  size_t n = (size_t) st.st_size / sizeof(struct custom_trace_record);
+  if (n == 0 || n >= NO_ID) {
+    fprintf(stderr, "%s: not a trace or too big\n", path);
+    exit(1);
+  }
+  struct custom_trace_record *records = mmap(NULL, n * sizeof(*records), PROT_READ, MAP_PRIVATE,
+      fd, 0);
+  if (records == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  close(fd);
+  calls = map(n * sizeof(call_t));
+  for (size_t i = 0; i < n; i++) {
+    calls[i] = (call_t) {records[i].time, records[i].size, (uint32_t) i, NO_ID, NO_ID,
+        records[i].op, records[i].alignment_shift};
+    if (records[i].thread >= num_threads) {
+      num_threads = records[i].thread + 1;
+    }
+  }
+  qsort(calls, n, sizeof(call_t), compare_calls);
+
+  // Sizes of the allocations that are live, by id, to add up the bytes that the trace has live
+  uint64_t *sizes = map((n + 1) * sizeof(uint64_t));
+  size_t live = 0;
+  for (size_t i = 0; i < n; i++) {
+    call_t *c = &calls[i];
+    struct custom_trace_record *r = &records[c->index];
+    if (c->op == CUSTOM_TRACE_FREE && r->ptr == 0) {
+      c->op = UINT16_MAX;
+      continue;
+    }
+    if ((c->op == CUSTOM_TRACE_FREE || c->op == CUSTOM_TRACE_REALLOC) && r->ptr != 0) {
+      bool freed = c->op == CUSTOM_TRACE_FREE || r->result != 0 || c->size == 0;
+      c->in = freed ? live_take(r->ptr) : NO_ID;
+      if (c->in == NO_ID) {
+        // A realloc that failed leaves its allocation alone, so it has nothing to replay either
+        skipped++;
+        c->op = UINT16_MAX;
+        continue;
+      }
+      live -= sizes[c->in];
+    }
+    if (c->op != CUSTOM_TRACE_FREE && r->result != 0) {
+      c->out = (uint32_t) num_ids;
+      sizes[num_ids++] = c->size;
+      // An address can only be handed out again once it was freed, but that free can be recorded a
+      // little later than the allocation if the two raced, so the old allocation is let go of here
+      uint32_t stale = live_take(r->result);
+      if (stale != NO_ID) {
+        live -= sizes[stale];
+        if (c->op != CUSTOM_TRACE_REALLOC) {
+          c->in = stale;
+        }
+      }
+      live_put(r->result, c->out);
+      live += c->size;
+      if (live > peak_live) {
+        peak_live = live;
+      }
+    }
+  }
+  num_calls = n;
+  munmap(records, n * sizeof(*records));
+  munmap(sizes, (n + 1) * sizeof(uint64_t));
+}
+
+// Write to every page of a new allocation, like a program filling it in would
+void touch(char *p, size_t size) {
+  for (size_t i = 0; i < size; i += 4096) {
+    p[i] = 1;
+  }
+}
+
+// Get the RSS of this process in KiB
+long current_rss(void) {
+  long pages = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f != NULL) {
+    if (fscanf(f, "%*s %ld", &pages) != 1) {
+      pages = 0;
+    }
+    fclose(f);
+  }
+  return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Replay every call with an allocator, and count the time spent in it. New memory is touched after
+// the clock stops, since its page faults depend on how much of it the allocator had to map
+void replay(allocator_t *a, result_t *r) {
+  void **slots = map((num_ids + 1) * sizeof(void *));
+  memset(slots, 0, (num_ids + 1) * sizeof(void *));
+  r->base_rss = current_rss();
+  uint64_t ns = 0;
+  for (size_t i = 0; i < num_calls; i++) {
+    call_t *c = &calls[i];
+    void *p = NULL;
+    uint64_t start = now_ns();
+    if (c->op != CUSTOM_TRACE_REALLOC && c->op != CUSTOM_TRACE_FREE && c->in != NO_ID) {
+      a->free(slots[c->in]);
+      slots[c->in] = NULL;
+    }
+    switch (c->op) {
+      case CUSTOM_TRACE_MALLOC:
+        p = a->malloc(c->size);
+        break;
+      case CUSTOM_TRACE_CALLOC:
+        p = a->calloc(1, c->size);
+        break;
+      case CUSTOM_TRACE_ALIGNED_ALLOC: {
+        // aligned_alloc needs the size to be a multiple of the alignment for some allocators
+        size_t alignment = (size_t) 1 << c->alignment_shift;
+        p = a->aligned_alloc(alignment, (c->size + alignment - 1) & ~(alignment - 1));
+        break;
+      }
+      case CUSTOM_TRACE_REALLOC:
+        p = a->realloc(c->in != NO_ID ? slots[c->in] : NULL, c->size);
+        if (c->in != NO_ID) {
+          slots[c->in] = NULL;
+        }
+        break;
+      case CUSTOM_TRACE_FREE:
+        a->free(slots[c->in]);
+        slots[c->in] = NULL;
+        break;
+      default:
+        break;
+    }
+    if (c->out == NO_ID && p != NULL) {
+      a->free(p);
+    }
+    ns += now_ns() - start;
+    if (c->out != NO_ID) {
+      slots[c->out] = p;
+      if (p != NULL && c->op != CUSTOM_TRACE_CALLOC) {
+        touch(p, c->size);
+      }
+    }
+  }
+  r->ns = ns;
+}
+
+// Add another allocator from a shared library if it is installed. It is loaded with its symbols
+// kept local so that it only serves the calls made through its table entry
+void add_library(const char *name, const char *file, const char *prefix) {
+  void *handle = dlopen(file, RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL) {
+    return;
+  }
+  const char *names[] = {"malloc", "calloc", "realloc", "free", "aligned_alloc"};
+  void *functions[5];
+  for (size_t i = 0; i < 5; i++) {
+    char symbol[64];
+    snprintf(symbol, sizeof(symbol), "%s%s", prefix, names[i]);
+    functions[i] = dlsym(handle, symbol);
+    if (functions[i] == NULL) {
+      dlclose(handle);
+      return;
+    }
+  }
+  allocator_t *a = &allocators[num_allocators++];
+  a->name = name;
+  a->malloc = (void *(*)(size_t)) functions[0];
+  a->calloc = (void *(*)(size_t, size_t)) functions[1];
+  a->realloc = (void *(*)(void *, size_t)) functions[2];
+  a->free = (void (*)(void *)) functions[3];
+  a->aligned_alloc = (void *(*)(size_t, size_t)) functions[4];
+}
+
+// Replay the trace with an allocator in a child process and print its results
+void run(allocator_t *a) {
+  int fds[2];
+  if (pipe(fds) == -1) {
+    perror("pipe");
+    exit(1);
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    result_t r = {0};
+    replay(a, &r);
+    if (write(fds[1], &r, sizeof(r)) != sizeof(r)) {
+      _exit(1);
+    }
+    _exit(0);
+  }
+  close(fds[1]);
+  result_t r;
+  ssize_t n = read(fds[0], &r, sizeof(r));
+  close(fds[0]);
+  int status;
+  struct rusage usage;
+  wait4(pid, &status, 0, &usage);
+  if (n != sizeof(r) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    printf("%-10s failed\n", a->name);
+    return;
+  }
+  long rss = usage.ru_maxrss - r.base_rss;
+  printf("%-10s %12.1f %14.0f %12ld", a->name, (double) r.ns / 1e6,
+      (double) num_calls * 1e9 / (double) r.ns, rss);
+  if (peak_live != 0) {
+    printf(" %10.2f", (double) rss * 1024 / (double) peak_live);
+  }
+  printf("\n");
+}
+
+void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-a allocator] trace\n", prog);
+  fprintf(stderr, "  -a  only replay with the allocator with this name\n");
+}
+
+int main(int argc, char **argv) {
+  const char *only_allocator = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "a:h")) != -1) {
+    switch (opt) {
+      case 'a':
+        only_allocator = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  allocators[num_allocators++] = (allocator_t) {"custom", custom_malloc, custom_calloc,
+      custom_realloc, custom_free, custom_aligned_alloc};
+  allocators[num_allocators++] = (allocator_t) {"glibc", malloc, calloc, realloc, free,
+      aligned_alloc};
+  add_library("jemalloc", "libjemalloc.so.2", "");
+  add_library("mimalloc", "libmimalloc.so.2", "mi_");
+
+  load_trace(argv[optind]);
+  printf("%zu calls from %zu threads, %zu KiB live at the peak, %zu calls skipped\n", num_calls,
+      num_threads, peak_live / 1024, skipped);
+  printf("%-10s %12s %14s %12s %10s\n", "allocator", "time ms", "calls/sec", "peak RSS KiB",
+      "RSS/live");
+  for (size_t i = 0; i < num_allocators; i++) {
+    if (only_allocator == NULL || strcmp(only_allocator, allocators[i].name) == 0) {
+      run(&allocators[i]);
+    }
+  }
+  return 0;
+}
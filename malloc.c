@@ -1,11 +1,30 @@
+#define _GNU_SOURCE
 #define _DEFAULT_SOURCE
 #define _BSD_SOURCE 
 #include <stdio.h> 
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <signal.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "malloc.h"
 
@@ -15,194 +34,3307 @@
 #define debug_printf(...)
 #endif
 
-// Magic number for headers to ensure that the heap isn't corrupted (this is a uint_32t)
-#define MAGIC 0xDEADC0DE
+// Magic number for headers to ensure that the heap isn't corrupted (this is a uint_32t)
+#define MAGIC 0xDEADC0DE
+
+// Building with HARDENED makes the heap harder to corrupt on purpose and stops the program as soon
+// as corruption is found, instead of ignoring the bad pointer. Header checks are derived from a
+// secret that is picked at random when the allocator starts so that they can't be forged, pointers
+// that are kept in freed memory are mangled with the secret and the address that they are stored at
+// (like glibc's safe-linking) and checked when they are read back, and mapped allocations are
+// followed by a guard page
+uintptr_t heap_secret = 0;
+
+// Every allocation is aligned to ALIGNMENT so that it can hold any type. Requests are rounded up to
+// a multiple of CLASS_STEP, which keeps every block a multiple of the alignment. Requests up to
+// SMALL_MAX bytes each get an exact fit size class, and larger ones are classed by power of two
+#define ALIGNMENT _Alignof(max_align_t)
+#define CLASS_STEP ((size_t) 16)
+#define SMALL_MAX_SHIFT 9
+#define SMALL_MAX ((size_t) 1 << SMALL_MAX_SHIFT)
+#define NUM_SMALL_BINS (SMALL_MAX / CLASS_STEP)
+#define NUM_LARGE_BINS (sizeof(size_t) * 8 - SMALL_MAX_SHIFT)
+#define NUM_BINS (NUM_SMALL_BINS + NUM_LARGE_BINS)
+
+// Free blocks are binned two levels deep like in TLSF so that finding one that fits takes constant
+// time. Small blocks have an exact fit bin for their size class, and large blocks are binned by
+// power of two and then by which of SUB_BINS equal slices of it their size falls in. A bitmap of
+// the bins that aren't empty and a summary of which of its words aren't zero let the first bin big
+// enough for a request be found with two bit scans
+#define SUB_BIN_SHIFT 3
+#define SUB_BINS ((size_t) 1 << SUB_BIN_SHIFT)
+#define NUM_FREE_BINS (NUM_SMALL_BINS + NUM_LARGE_BINS * SUB_BINS)
+#define BINMAP_WORDS ((NUM_FREE_BINS + 63) / 64)
+
+// Free blocks that are bigger than needed are split, as long as what is left over has room for at
+// least SPLIT_MIN bytes of data. Smaller leftovers stay with the allocated block
+#ifndef SPLIT_MIN
+#define SPLIT_MIN ((size_t) 64)
+#endif
+
+// calloc zeroes blocks of at least NT_ZERO_MIN bytes with stores that bypass the cache. Blocks that
+// big are usually mapped and already zero, so the cutoff is lowered to half of mmap_threshold to
+// cover the biggest blocks that are actually reused from the heap
+#ifndef NT_ZERO_MIN
+#define NT_ZERO_MIN ((size_t) 1 << 20)
+#endif
+
+// Header flags. The bits from HDR_ARENA_SHIFT up hold the index of the arena that owns the block.
+// A cached block is allocated as far as its arena is concerned but is sitting in a thread cache
+#define HDR_FREE 0x1
+#define HDR_MMAPPED 0x2
+#define HDR_CACHED 0x4
+#define HDR_DECAYING 0x8
+#define HDR_ARENA_SHIFT 8
+
+// Allocations of at least mmap_threshold bytes don't come from an arena. They are mapped on their
+// own and unmapped as soon as they are freed so that big buffers go straight back to the OS. Like
+// glibc's, the threshold starts at MMAP_THRESHOLD and rises to the size of every mapped block that
+// is freed, up to MMAP_THRESHOLD_MAX, with trim_threshold kept at twice that. A program that keeps
+// allocating and freeing buffers of the same size then reuses them from the heap instead of paying
+// for a mapping and the page faults every time. Setting either threshold turns this off
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD ((size_t) 128 << 10)
+#endif
+#ifndef MMAP_THRESHOLD_MAX
+#define MMAP_THRESHOLD_MAX ((size_t) 32 << 20)
+#endif
+atomic_size_t mmap_threshold = MMAP_THRESHOLD;
+atomic_bool thresholds_fixed = false;
+
+// The heap is split into arenas which each have their own lock, bins and memory so that threads
+// allocating from different arenas never contend. Every thread is assigned an arena round robin the
+// first time that it needs one, and a block is always given back to the arena it came from. Arenas
+// take their segments out of the heap region, and if that runs out the main arena (arena 0) grows
+// the program break with sbrk and the others map segments of their own
+#define MAX_ARENAS 64
+#define ARENAS_PER_CPU 4
+
+// On machines with more than one NUMA node, arena i belongs to node i % num_nodes. Threads are
+// given an arena of the node they are running on, and the memory of every segment is bound to the
+// node of its arena so that the pages come from that node no matter which thread touches them
+// first. The stats only look up which node a thread is running on every NODE_RECHECK allocations
+#define MAX_NODES 64
+#define NODE_RECHECK 256
+size_t num_nodes = 1;
+
+// Arenas grow in chunks so that a growing workload doesn't make a system call for every block that
+// is added to the top of an arena. The chunk size of an arena starts at HEAP_GROW_MIN and doubles
+// every time the arena grows, up to HEAP_GROW_MAX. Once more than trim_threshold bytes at the top
+// of an arena are unused, all but HEAP_GROW_MIN of them are given back to the OS, and free blocks
+// of at least trim_threshold bytes give back the pages inside of them
+#ifndef HEAP_GROW_MIN
+#define HEAP_GROW_MIN ((size_t) 128 << 10)
+#endif
+#ifndef HEAP_GROW_MAX
+#define HEAP_GROW_MAX ((size_t) 64 << 20)
+#endif
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD ((size_t) 256 << 10)
+#endif
+atomic_size_t trim_threshold = TRIM_THRESHOLD;
+
+// Arenas grow out of one big region of address space that is reserved up front, so that growing
+// takes an atomic bump of the next free address instead of a system call that every arena would
+// have to queue up behind. Nothing in the region is backed by memory until it is used, and it is
+// aligned to a huge page so that chunks of whole huge pages stay aligned. An arena whose newest
+// segment ends where the free part of the region starts grows that segment in place, like the main
+// arena used to grow the program break
+#ifndef HEAP_REGION_SIZE
+#define HEAP_REGION_SIZE (SIZE_MAX > 0xFFFFFFFF ? (size_t) 64 << 30 : (size_t) 1 << 30)
+#endif
+char *heap_region = NULL;
+char *heap_region_end = NULL;
+_Atomic(char *) heap_next = NULL;
+pthread_once_t heap_region_once = PTHREAD_ONCE_INIT;
+
+// With huge pages turned on, arena segments are aligned to HUGE_PAGE_SIZE and grow by whole huge
+// pages, and they and the slab region are advised to be backed by transparent huge pages. Memory is
+// then only given back to the OS in whole huge pages so that khugepaged doesn't have to keep
+// putting them back together, and empty slabs keep their memory since they are smaller than a huge
+// page. HUGE_PAGES sets the default, which the CUSTOM_MALLOC_HUGEPAGES environment variable
+// overrides
+#define HUGE_PAGE_SIZE ((size_t) 2 << 20)
+#ifndef HUGE_PAGES
+#define HUGE_PAGES 0
+#endif
+bool huge_pages = HUGE_PAGES;
+
+// Freed memory isn't given back to the OS right away, since it is often about to be used again.
+// Free blocks with whole pages inside of them and empty slabs go on their arena's dirty list, and
+// are purged oldest first so that the memory freed at any moment is given back along a smooth curve
+// over the next decay_time milliseconds. Purging advises dirty memory with MADV_FREE, which only
+// takes the pages if the system runs short, and moves it to the arena's muzzy list to be advised
+// with MADV_DONTNEED along the same curve. Arenas purge every DECAY_TICKS frees and trim their top
+// then too, at most once every DECAY_STEPS-th of the decay time, and a background thread can purge
+// them so that memory is given back even when nothing is being freed. A decay time of 0 gives
+// memory back as soon as it is freed
+#ifndef DECAY_TIME
+#define DECAY_TIME ((size_t) 10000)
+#endif
+#define DECAY_STEPS 32
+#define DECAY_TICKS 64
+atomic_size_t decay_time = DECAY_TIME;
+atomic_bool background_thread = false;
+bool background_running = false;
+pthread_mutex_t background_lock = PTHREAD_MUTEX_INITIALIZER;
+
+enum {
+  DECAY_DIRTY,
+  DECAY_MUZZY,
+  NUM_DECAY_LISTS
+};
+
+// Link of memory in a dirty or muzzy list, along with the pages that it covers. Free blocks keep it
+// in their data past the free list links, and slabs in their metadata. The list is one more than
+// its index, or 0 when the memory isn't on one
+typedef struct dirty {
+  struct dirty *older;
+  struct dirty *newer;
+  char *start;
+  size_t size;
+  uint8_t list;
+  bool slab;
+} dirty_t;
+
+// Memory waiting to be purged, oldest first, and the number of bytes on the list now and when the
+// current epoch started. The bytes that the list grew by in each of the last DECAY_STEPS epochs are
+// kept in added, newest first, which is what decides how many can stay. Counting growth means that
+// a free block that is split and merged again over and over doesn't count as new every time
+typedef struct decay_list {
+  dirty_t *oldest;
+  dirty_t *newest;
+  size_t bytes;
+  size_t epoch_bytes;
+  size_t added[DECAY_STEPS];
+} decay_list_t;
+
+// Contiguous region of memory owned by an arena. The segment record sits at the start of the region
+// and blocks are placed right after it
+typedef struct segment {
+  char *end;
+  struct segment *next;
+} segment_t;
+
+// Links of a free block in the bin for its size. Both links go both ways so that any free block
+// can be unlinked from just its header
+typedef struct free_links {
+  struct header *next_free;
+  struct header *prev_free;
+} free_links_t;
+
+// Header which sits right before a block of user memory. The blocks of a segment are in a doubly
+// linked list through their headers, and free blocks are additionally in the bin for their size.
+//
+// The default header holds all of its links as pointers. Building with COMPACT_HEADERS shrinks it
+// from 48 to 16 bytes: the last block of a segment is flagged instead of having a next link, since
+// every other block's next block starts right after its data, the previous block is stored as a 31
+// bit distance in CLASS_STEP units, the free links live in the data of the free block that they
+// belong to, and the magic number is replaced by a 16 bit check that is derived from the header's
+// address. Heap blocks can be at most MAX_HEAP_DSIZE bytes so that every distance fits
+#ifdef COMPACT_HEADERS
+typedef struct header {
+  size_t dsize;
+  uint32_t prev_link;
+  uint16_t flags;
+  uint16_t check;
+} header_t;
+
+#define PREV_LAST ((uint32_t) 1 << 31)
+#define MAX_HEAP_DSIZE (((size_t) PREV_LAST - 1) * CLASS_STEP - 2 * sizeof(header_t))
+#else
+typedef struct header {
+  size_t dsize;
+  uint32_t magic;
+  uint32_t flags;
+  struct header *next;
+  struct header *prev;
+  free_links_t links;
+} header_t;
+
+#define MAX_HEAP_DSIZE (SIZE_MAX / 2)
+#endif
+
+// Small objects of up to slab_max_size bytes (SLAB_MAX at most, and 0 turns slabs off) don't get a
+// header. They are packed into SLAB_SIZE byte slabs that each hold objects of a single size class,
+// and the slabs are carved out of one region of address space that is reserved up front. The
+// metadata for every slab lives in a table next to the region instead of inside the slab, so the
+// slab of an object is found by indexing the table with the object's offset into the region and the
+// whole slab is available to objects. Empty slabs wait to be reused on their arena's dirty list
+// like free blocks do
+#define SLAB_SHIFT 12
+#define SLAB_SIZE ((size_t) 1 << SLAB_SHIFT)
+#define SLAB_MAGIC 0x51AB51AB
+#define SLAB_BITMAP_WORDS (SLAB_SIZE / CLASS_STEP / 64)
+#ifndef SLAB_MAX
+#define SLAB_MAX ((size_t) 256)
+#endif
+#ifndef SLAB_REGION_SIZE
+#define SLAB_REGION_SIZE ((size_t) 1 << 30)
+#endif
+#define NUM_SLAB_CLASSES (SLAB_MAX / CLASS_STEP)
+atomic_size_t slab_max_size = SLAB_MAX;
+
+// Metadata for a slab. A set bit in the bitmap means that the object in that slot is allocated, and
+// the bits past the slab's capacity are always set
+typedef struct slab {
+  struct slab *next;
+  struct slab *prev;
+  uint64_t bitmap[SLAB_BITMAP_WORDS];
+  uint32_t magic;
+  uint16_t size;
+  uint16_t capacity;
+  uint16_t nfree;
+  uint16_t arena;
+  dirty_t dirty;
+} slab_t;
+
+// The slab region, the table of metadata for its slabs, and the index of the next slab that has
+// never been handed out
+char *slab_region = NULL;
+char *slab_region_end = NULL;
+slab_t *slab_table = NULL;
+atomic_size_t slab_next = 0;
+pthread_once_t slab_region_once = PTHREAD_ONCE_INIT;
+
+_Static_assert(CLASS_STEP % ALIGNMENT == 0, "size classes must keep blocks aligned");
+_Static_assert(sizeof(header_t) % ALIGNMENT == 0, "headers must keep user memory aligned");
+_Static_assert(sizeof(segment_t) % ALIGNMENT == 0, "segment records must keep blocks aligned");
+_Static_assert(CLASS_STEP >= sizeof(free_links_t), "free blocks must have room for their links");
+
+// When a thread's cache drains a bin, the batch goes into one of its arena's transfer slots for the
+// size class if there is an empty one, and a thread whose cache bin runs empty takes a whole batch
+// back out, both without the arena's lock. A batch is put into an empty slot with a compare and
+// swap and taken out with an exchange, so unlike popping a list of batches nothing is ever read
+// through a head that another thread could have taken, reused and put back in the meantime (the
+// ABA problem). The slots are emptied back into the arena once a decay epoch
+#define TRANSFER_SLOTS 4
+
+// An arena takes back the small objects that other threads freed into it whenever it is locked to
+// allocate, and once a decay epoch. So that a queue whose arena has gone idle can't keep growing,
+// the thread that pushes the REMOTE_DRAIN_MAX-th object onward gives them back itself if it can get
+// the arena's lock without waiting
+#define REMOTE_DRAIN_MAX 256
+
+// An independent heap with its own lock. Everything in here must only be used with the lock held
+typedef struct arena {
+  pthread_mutex_t lock;
+  // The segments of the arena, newest first. New blocks are added at top in the newest segment, and
+  // everything from purged to the end of that segment has already been given back to the OS
+  segment_t *segments;
+  char *top;
+  char *purged;
+  // Size of the next chunk that the arena will grow by
+  size_t grow_size;
+  // The last block in the arena, which is where new blocks get appended when no free block fits
+  header_t *last;
+  // Heads of the free lists for each bin, a bitmap of which of them aren't empty and a bitmap of
+  // which words of that aren't zero
+  header_t *bins[NUM_FREE_BINS];
+  uint64_t binmap[BINMAP_WORDS];
+  uint64_t binmap_summary;
+  // Slabs with free slots for each slab size class, and empty slabs that can be used for any class
+  slab_t *slabs[NUM_SLAB_CLASSES];
+  slab_t *empty_slabs;
+  // Memory waiting to be purged, when the current decay epoch started in nanoseconds, and how many
+  // more frees there are until the arena purges again
+  decay_list_t decay[NUM_DECAY_LISTS];
+  uint64_t decay_epoch;
+  uint32_t decay_ticks;
+  uint32_t index;
+  uint32_t node;
+  // Small objects freed by threads that use other arenas, and about how many there are. These and
+  // the transfer slots are the only fields that can be used without the lock: other threads push
+  // onto the queue, and whoever locks the arena to allocate takes everything off of it and gives it
+  // back
+  _Atomic(struct tcache_entry *) remote_frees;
+  atomic_size_t remote_count;
+  _Atomic(struct tcache_entry *) transfer[NUM_SMALL_BINS][TRANSFER_SLOTS];
+} arena_t;
+
+arena_t arenas[MAX_ARENAS];
+size_t num_arenas = 0;
+pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+
+// Round robin counter used to hand out arenas, and the arena the calling thread was given
+atomic_size_t next_arena = 0;
+__thread arena_t *thread_arena = NULL;
+pthread_once_t fork_handlers_once = PTHREAD_ONCE_INIT;
+
+// Each thread keeps a cache of recently freed small objects for every small size class so that
+// malloc and free on the same thread don't have to take an arena lock. A cache bin holds at most
+// tcache_max objects (up to TCACHE_LIMIT, and 0 turns caching off). It is refilled from the arenas
+// TCACHE_BATCH objects at a time and drained to them half of it at a time, each with a single lock
+// acquisition
+#define TCACHE_MAX 32
+#define TCACHE_BATCH 16
+#define TCACHE_LIMIT 4096
+atomic_size_t tcache_max = TCACHE_MAX;
+
+// Cached objects are still allocated as far as their arena is concerned. They are chained through
+// their first word and have the address of the cache that holds them in their second, which is
+// what lets free detect a double free of a cached object. Objects that have a header are also
+// flagged as cached
+typedef struct tcache_entry {
+  struct tcache_entry *next;
+  void *key;
+} tcache_entry_t;
+
+typedef struct tcache {
+  tcache_entry_t *bins[NUM_SMALL_BINS];
+  uint32_t counts[NUM_SMALL_BINS];
+  struct tcache *next;
+  struct tcache *prev;
+  bool registered;
+} tcache_t;
+
+__thread tcache_t tcache;
+
+// The caches of running threads are linked together, so that the child of a fork can take back
+// what the threads that didn't make it through the fork had cached
+tcache_t *tcache_threads = NULL;
+pthread_mutex_t tcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Key whose destructor gives a thread's cached blocks back to their arenas when it exits
+pthread_key_t tcache_key;
+pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+// Every thread counts what it does in its own stats so that keeping them doesn't add any
+// contention. The stats of running threads are linked together and those of exited threads are
+// added into retired_stats, so they can all be added up when someone asks for them. Byte counts are
+// kept as amounts added and taken away by each thread, which can wrap around for a thread that
+// frees what others allocated, but the totals still come out right
+enum {
+  STAT_IN_USE,
+  STAT_MAPPED,
+  STAT_DIRECT_MAPPED,
+  STAT_SBRK_CALLS,
+  STAT_MMAP_CALLS,
+  STAT_MUNMAP_CALLS,
+  STAT_MREMAP_CALLS,
+  STAT_MADVISE_CALLS,
+  STAT_MBIND_CALLS,
+  STAT_SEARCHES,
+  STAT_SEARCH_STEPS,
+  STAT_LOCAL_BYTES,
+  STAT_REMOTE_BYTES,
+  STAT_DIRTY_BYTES,
+  STAT_MUZZY_BYTES,
+  NUM_STATS
+};
+
+typedef struct thread_stats {
+  atomic_size_t counts[NUM_STATS];
+  // Allocations and frees for each size class, where a class is a bin
+  atomic_size_t allocs[NUM_BINS];
+  atomic_size_t frees[NUM_BINS];
+  struct thread_stats *next;
+  struct thread_stats *prev;
+  bool registered;
+  // Whether the thread was running off its arena's node when it last looked, and the allocations
+  // until it looks again
+  bool off_node;
+  uint32_t node_countdown;
+} thread_stats_t;
+
+__thread thread_stats_t stats;
+
+thread_stats_t *stats_threads = NULL;
+thread_stats_t retired_stats;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Key whose destructor retires a thread's stats when it exits
+pthread_key_t stats_key;
+pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+// Regions hand out memory by bumping a pointer through chunks that are allocated like anything
+// else, and free all of it at once. Chunks start at REGION_CHUNK_MIN bytes or the region's size
+// hint and double up to REGION_CHUNK_MAX. Every thread keeps up to REGION_POOL_MAX bytes of chunks
+// from the regions it resets so that reusing a region doesn't have to allocate them again
+#define REGION_CHUNK_MIN ((size_t) 64 << 10)
+#define REGION_CHUNK_MAX ((size_t) 4 << 20)
+#define REGION_POOL_MAX ((size_t) 16 << 20)
+
+typedef struct region_chunk {
+  struct region_chunk *next;
+  // Number of bytes after the chunk's header
+  size_t size;
+} region_chunk_t;
+
+_Static_assert(sizeof(region_chunk_t) % ALIGNMENT == 0, "chunk headers must keep regions aligned");
+
+struct custom_arena {
+  region_chunk_t *chunks;
+  char *ptr;
+  char *end;
+  size_t first_size;
+  size_t next_size;
+};
+
+typedef struct region_pool {
+  region_chunk_t *chunks;
+  size_t bytes;
+  bool registered;
+} region_pool_t;
+
+__thread region_pool_t region_pool;
+
+// Key whose destructor frees a thread's pooled chunks when it exits
+pthread_key_t region_pool_key;
+pthread_once_t region_pool_key_once = PTHREAD_ONCE_INIT;
+
+// The heap profiler samples allocations as a Poisson process over the bytes allocated, so that on
+// average one sample is taken every prof_rate bytes no matter how big the allocations are. Every
+// thread counts down the bytes until its next sample, so an allocation that isn't sampled costs a
+// subtraction and a branch. Sampled allocations are kept with their backtrace in a hash table until
+// they are freed, and a counting filter indexed by address tells free whether the pointer could be
+// in the table without taking its lock. While profiling is off, threads only look again at whether
+// it was turned on every PROF_RECHECK bytes
+#define PROF_MAX_DEPTH 32
+#define PROF_BUCKETS 4096
+#define PROF_FILTER_SIZE 65536
+#define PROF_POOL_CHUNK ((size_t) 64 << 10)
+#define PROF_RECHECK ((intptr_t) 64 << 20)
+
+typedef struct prof_sample {
+  struct prof_sample *next;
+  void *ptr;
+  size_t size;
+  int depth;
+  void *stack[PROF_MAX_DEPTH];
+} prof_sample_t;
+
+atomic_size_t prof_rate = 0;
+atomic_size_t prof_live = 0;
+atomic_uchar prof_filter[PROF_FILTER_SIZE];
+prof_sample_t *prof_buckets[PROF_BUCKETS];
+prof_sample_t *prof_free_samples = NULL;
+pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Bytes until the calling thread takes its next sample, its random number generator, and whether it
+// is in the middle of taking one, since getting a backtrace can allocate
+__thread intptr_t prof_countdown = 0;
+__thread uint64_t prof_rng = 0;
+__thread bool prof_busy = false;
+
+// Where a profile is written to when the profiling signal arrives, and whether one is still owed
+// because the signal came while the profile was locked
+char prof_signal_path[256];
+atomic_bool prof_dump_pending = false;
+
+// While tracing, every thread appends a record of each call it makes to a ring of TRACE_RECORDS
+// records of its own without taking any locks, and a full ring is written out to the trace file
+// under trace_lock. Tracing can be stopped by any thread, so the rings are single producer single
+// consumer, with whoever holds the lock as the consumer. Rings are mapped outside of the heap and
+// are never unmapped, since a thread that exits gives its ring to the next thread that needs one
+#ifndef TRACE_RECORDS
+#define TRACE_RECORDS 4096
+#endif
+
+typedef struct trace_ring {
+  struct custom_trace_record records[TRACE_RECORDS];
+  atomic_size_t head;
+  atomic_size_t tail;
+  uint32_t thread;
+  bool owned;
+  struct trace_ring *next;
+} trace_ring_t;
+
+atomic_bool tracing = false;
+int trace_fd = -1;
+uint64_t trace_start_ns = 0;
+uint32_t trace_next_thread = 0;
+trace_ring_t *trace_rings = NULL;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The calling thread's ring, and how deep it is in calls into the allocator that are being traced
+__thread trace_ring_t *trace_ring = NULL;
+__thread int trace_depth = 0;
+
+// Key whose destructor writes out an exiting thread's ring and gives it up
+pthread_key_t trace_key;
+pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+// Report that the heap is corrupted or that the program gave the allocator a bad pointer. Hardened
+// builds write the message without allocating and abort
+void heap_error(const char *message) {
+#ifdef HARDENED
+  static const char prefix[] = "custom_malloc: ";
+  ssize_t res = write(STDERR_FILENO, prefix, sizeof(prefix) - 1);
+  res = write(STDERR_FILENO, message, strlen(message));
+  res = write(STDERR_FILENO, "\n", 1);
+  (void) res;
+  abort();
+#else
+  (void) message;
+  debug_printf("%s\n", message);
+#endif
+}
+
+// Mangle a pointer that is about to be stored in slot, or unmangle one that was read from there.
+// This only does anything in hardened builds
+void *mangle(const void *slot, const void *ptr) {
+#ifdef HARDENED
+  return (void *) ((uintptr_t) ptr ^ ((uintptr_t) slot >> 12) ^ heap_secret);
+#else
+  (void) slot;
+  return (void *) ptr;
+#endif
+}
+
+// Unmangle a link between pieces of the heap that was read from slot. Everything that is linked
+// together is at least pointer aligned, so a link that comes out misaligned has been overwritten
+void *unmangle_link(const void *slot, const void *stored) {
+  void *ptr = mangle(slot, stored);
+#ifdef HARDENED
+  if ((uintptr_t) ptr % sizeof(void *) != 0) {
+    heap_error("Corrupted free list link");
+  }
+#endif
+  return ptr;
+}
+
+// Round a requested size up to the data size of its size class. Sizes too big to round up come back
+// as SIZE_MAX, which no allocation can satisfy
+size_t class_size(size_t s) {
+  if (s == 0) {
+    return CLASS_STEP;
+  }
+  if (s > SIZE_MAX - CLASS_STEP) {
+    return SIZE_MAX;
+  }
+  return (s + CLASS_STEP - 1) & ~(CLASS_STEP - 1);
+}
+
+// Get the index of the bin that holds free blocks with the given data size
+size_t bin_index(size_t dsize) {
+  if (dsize <= SMALL_MAX) {
+    return dsize == 0 ? 0 : (dsize - 1) / CLASS_STEP;
+  }
+  size_t log2 = sizeof(size_t) * 8 - 1 - (size_t) __builtin_clzl(dsize);
+  return NUM_SMALL_BINS + log2 - SMALL_MAX_SHIFT;
+}
+
+// Get the index of the free bin whose range of sizes holds dsize
+size_t free_bin_index(size_t dsize) {
+  if (dsize <= SMALL_MAX) {
+    return bin_index(dsize);
+  }
+  size_t log2 = sizeof(size_t) * 8 - 1 - (size_t) __builtin_clzl(dsize);
+  size_t sub = (dsize >> (log2 - SUB_BIN_SHIFT)) & (SUB_BINS - 1);
+  return NUM_SMALL_BINS + (log2 - SMALL_MAX_SHIFT) * SUB_BINS + sub;
+}
+
+// Get the index of the first free bin where every block can hold dsize bytes. That is the bin
+// after the one that holds dsize, unless dsize is at the very start of that bin's range
+size_t fit_bin_index(size_t dsize) {
+  if (dsize <= SMALL_MAX) {
+    return bin_index(dsize);
+  }
+  size_t log2 = sizeof(size_t) * 8 - 1 - (size_t) __builtin_clzl(dsize);
+  size_t step = (size_t) 1 << (log2 - SUB_BIN_SHIFT);
+  size_t i = free_bin_index(dsize);
+  return (dsize & (step - 1)) == 0 ? i : i + 1;
+}
+
+// Get the size of a page of memory
+size_t page_size(void) {
+  return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+// Get the current time in nanoseconds
+uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+// Get the size of the inaccessible guard that hardened builds leave after every mapped block, so
+// that running off the end of one faults instead of reaching whatever got mapped after it
+size_t guard_size(void) {
+#ifdef HARDENED
+  return page_size();
+#else
+  return 0;
+#endif
+}
+
+// Add n to a counter. Only the thread that owns a counter writes to it, so it doesn't need to be an
+// atomic add, it just can't tear for the thread that is adding the counters up
+void counter_add(atomic_size_t *counter, size_t n) {
+  size_t value = atomic_load_explicit(counter, memory_order_relaxed);
+  atomic_store_explicit(counter, value + n, memory_order_relaxed);
+}
+
+// Add a thread's stats into the retired stats and clear them. The stats lock must be held
+void retire_stats(thread_stats_t *st) {
+  for (size_t i = 0; i < NUM_STATS; i++) {
+    counter_add(&retired_stats.counts[i], atomic_load(&st->counts[i]));
+    atomic_store(&st->counts[i], 0);
+  }
+  for (size_t i = 0; i < NUM_BINS; i++) {
+    counter_add(&retired_stats.allocs[i], atomic_load(&st->allocs[i]));
+    counter_add(&retired_stats.frees[i], atomic_load(&st->frees[i]));
+    atomic_store(&st->allocs[i], 0);
+    atomic_store(&st->frees[i], 0);
+  }
+}
+
+// Add the exiting thread's stats into the retired stats and take them off the list of threads
+void stats_destroy(void *arg) {
+  (void) arg;
+  pthread_mutex_lock(&stats_lock);
+  retire_stats(&stats);
+  if (stats.prev != NULL) {
+    stats.prev->next = stats.next;
+  } else {
+    stats_threads = stats.next;
+  }
+  if (stats.next != NULL) {
+    stats.next->prev = stats.prev;
+  }
+  stats.registered = false;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_create_key(void) {
+  pthread_key_create(&stats_key, stats_destroy);
+}
+
+// Get the calling thread's stats, adding them to the list of threads the first time. Setting the
+// key's value can allocate, so the stats are registered before that to keep it from recursing
+thread_stats_t *thread_stats(void) {
+  if (!stats.registered) {
+    pthread_mutex_lock(&stats_lock);
+    stats.prev = NULL;
+    stats.next = stats_threads;
+    if (stats_threads != NULL) {
+      stats_threads->prev = &stats;
+    }
+    stats_threads = &stats;
+    stats.registered = true;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_once(&stats_key_once, stats_create_key);
+    pthread_setspecific(stats_key, &stats);
+  }
+  return &stats;
+}
+
+// Add n to one of the calling thread's counters
+void stat_add(size_t stat, size_t n) {
+  counter_add(&thread_stats()->counts[stat], n);
+}
+
+// Count an allocation that has room for dsize bytes of data
+void stat_alloc(size_t dsize) {
+  thread_stats_t *st = thread_stats();
+  counter_add(&st->counts[STAT_IN_USE], dsize);
+  counter_add(&st->allocs[bin_index(dsize)], 1);
+  // With more than one node, also count whether the thread is running on its arena's node. Asking
+  // costs a vDSO call or a system call, so the answer is kept for NODE_RECHECK allocations
+  if (num_nodes > 1 && thread_arena != NULL) {
+    if (st->node_countdown == 0) {
+      unsigned int cpu, node;
+      st->off_node = getcpu(&cpu, &node) == 0 && node != thread_arena->node;
+      st->node_countdown = NODE_RECHECK;
+    }
+    st->node_countdown--;
+    counter_add(&st->counts[st->off_node ? STAT_REMOTE_BYTES : STAT_LOCAL_BYTES], dsize);
+  } else {
+    counter_add(&st->counts[STAT_LOCAL_BYTES], dsize);
+  }
+}
+
+// Count the free of an allocation that had room for dsize bytes of data
+void stat_free(size_t dsize) {
+  thread_stats_t *st = thread_stats();
+  counter_add(&st->counts[STAT_IN_USE], -dsize);
+  counter_add(&st->frees[bin_index(dsize)], 1);
+}
+
+// Get the number of NUMA nodes from the highest one that is online, or 1 if that can't be read.
+// This runs while the allocator is being set up, so it can't use anything that allocates
+size_t count_nodes(void) {
+  int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return 1;
+  }
+  char buf[256];
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  // The file is a list of ranges like 0-1,3, so the last number in it is the highest node
+  size_t highest = 0;
+  size_t num = 0;
+  for (ssize_t i = 0; i < len; i++) {
+    if (buf[i] >= '0' && buf[i] <= '9') {
+      num = num * 10 + (size_t) (buf[i] - '0');
+      highest = num;
+    } else {
+      num = 0;
+    }
+  }
+  return highest + 1 < MAX_NODES ? highest + 1 : MAX_NODES;
+}
+
+// Settings can be changed while the program runs with custom_mallopt, or when it starts with the
+// CUSTOM_MALLOC_CONF environment variable, which is a list of name:value pairs separated by commas
+// like "mmap_threshold:1m,arenas:8". Sizes can end in k, m or g. The environment is read the first
+// time the allocator is set up or configured, so parsing it can't allocate. Settings that can
+// change while other threads allocate are atomics that are read relaxed, and the ones that the
+// arenas are laid out by can only be set before the arenas are
+typedef struct config_option {
+  const char *name;
+  int param;
+} config_option_t;
+
+const config_option_t config_options[] = {
+  {"mmap_threshold", CUSTOM_M_MMAP_THRESHOLD},
+  {"trim_threshold", CUSTOM_M_TRIM_THRESHOLD},
+  {"arenas", CUSTOM_M_ARENA_MAX},
+  {"tcache", CUSTOM_M_TCACHE_COUNT},
+  {"huge_pages", CUSTOM_M_HUGE_PAGES},
+  {"prof", CUSTOM_M_PROF_RATE},
+  {"decay_time", CUSTOM_M_DECAY_TIME},
+  {"background_thread", CUSTOM_M_BACKGROUND_THREAD},
+  {"slab_max", CUSTOM_M_SLAB_MAX},
+};
+
+#define NUM_CONFIG_OPTIONS (sizeof(config_options) / sizeof(config_options[0]))
+
+// Number of arenas to set up, or 0 to scale it with the number of CPUs
+size_t arena_limit = 0;
+pthread_once_t config_once = PTHREAD_ONCE_INIT;
+
+// Change a setting to the given value. Returns whether it was changed, which it isn't if the value
+// is out of range or the setting can't be changed anymore
+bool set_option(int param, size_t value) {
+  switch (param) {
+    case CUSTOM_M_MMAP_THRESHOLD:
+      // Small objects always come from the thread caches, and anything too big for the heap has to
+      // be mapped
+      if (value <= SMALL_MAX || value > MAX_HEAP_DSIZE) {
+        return false;
+      }
+      atomic_store_explicit(&thresholds_fixed, true, memory_order_relaxed);
+      atomic_store_explicit(&mmap_threshold, value, memory_order_relaxed);
+      return true;
+    case CUSTOM_M_TRIM_THRESHOLD:
+      atomic_store_explicit(&thresholds_fixed, true, memory_order_relaxed);
+      atomic_store_explicit(&trim_threshold, value, memory_order_relaxed);
+      return true;
+    case CUSTOM_M_ARENA_MAX:
+      // The arenas are only counted when they are set up
+      if (value > MAX_ARENAS || num_arenas != 0) {
+        return false;
+      }
+      arena_limit = value;
+      return true;
+    case CUSTOM_M_TCACHE_COUNT:
+      if (value > TCACHE_LIMIT) {
+        return false;
+      }
+      atomic_store_explicit(&tcache_max, value, memory_order_relaxed);
+      return true;
+    case CUSTOM_M_HUGE_PAGES:
+      // Segments that are already mapped were aligned and are purged for the setting they got
+      if (value > 1 || num_arenas != 0) {
+        return false;
+      }
+      huge_pages = value == 1;
+      return true;
+    case CUSTOM_M_PROF_RATE:
+      custom_malloc_prof_start(value);
+      return true;
+    case CUSTOM_M_DECAY_TIME:
+      if (value > UINT32_MAX) {
+        return false;
+      }
+      atomic_store_explicit(&decay_time, value, memory_order_relaxed);
+      return true;
+    case CUSTOM_M_BACKGROUND_THREAD:
+      if (value > 1) {
+        return false;
+      }
+      atomic_store_explicit(&background_thread, value == 1, memory_order_relaxed);
+      return true;
+    case CUSTOM_M_SLAB_MAX:
+      // Objects are found to be in a slab by their address, so slab objects that are already out
+      // are freed the same way after this changes
+      if (value > SLAB_MAX) {
+        return false;
+      }
+      atomic_store_explicit(&slab_max_size, value, memory_order_relaxed);
+      return true;
+  }
+  return false;
+}
+
+// Parse a number from the start of s into value, which can be in hex with 0x in front and can end
+// in k, m or g to count KiB, MiB or GiB. Returns a pointer to what follows it, or NULL if s doesn't
+// start with a number or it is too big
+const char *parse_size(const char *s, size_t *value) {
+  if (*s < '0' || *s > '9') {
+    return NULL;
+  }
+  int saved = errno;
+  errno = 0;
+  char *end;
+  unsigned long long n = strtoull(s, &end, 0);
+  bool overflow = errno == ERANGE || n > SIZE_MAX;
+  errno = saved;
+  int shift = *end == 'k' ? 10 : *end == 'm' ? 20 : *end == 'g' ? 30 : 0;
+  if (overflow || n > SIZE_MAX >> shift) {
+    return NULL;
+  }
+  *value = (size_t) n << shift;
+  return shift != 0 ? end + 1 : end;
+}
+
+// Apply the settings in a CUSTOM_MALLOC_CONF string. Pairs that don't name a setting or have a bad
+// value are skipped
+void parse_config(const char *conf) {
+  while (conf != NULL && *conf != '\0') {
+    const char *pair_end = conf + strcspn(conf, ",");
+    size_t name_len = strcspn(conf, ":,");
+    bool applied = false;
+    for (size_t i = 0; i < NUM_CONFIG_OPTIONS && conf[name_len] == ':'; i++) {
+      if (strlen(config_options[i].name) == name_len &&
+          strncmp(config_options[i].name, conf, name_len) == 0) {
+        size_t value;
+        applied = parse_size(conf + name_len + 1, &value) == pair_end &&
+            set_option(config_options[i].param, value);
+        break;
+      }
+    }
+    if (!applied) {
+      debug_printf("Skipping setting %.*s\n", (int) (pair_end - conf), conf);
+    }
+    conf = *pair_end == ',' ? pair_end + 1 : pair_end;
+  }
+}
+
+// Read the settings from the environment. CUSTOM_MALLOC_CONF comes last so that it wins over the
+// variables for single settings
+void init_config(void) {
+  const char *huge = getenv("CUSTOM_MALLOC_HUGEPAGES");
+  if (huge != NULL && huge[0] != '\0') {
+    huge_pages = strcmp(huge, "0") != 0;
+  }
+  const char *rate = getenv("CUSTOM_MALLOC_PROF");
+  if (rate != NULL) {
+    custom_malloc_prof_start(strtoull(rate, NULL, 0));
+  }
+  parse_config(getenv("CUSTOM_MALLOC_CONF"));
+  const char *trace = getenv("CUSTOM_MALLOC_TRACE");
+  if (trace != NULL && trace[0] != '\0') {
+    custom_malloc_trace_start(trace);
+  }
+}
+
+void start_background_thread(void);
+
+// Change one of the allocator's settings (one of the CUSTOM_M_ constants) to value. Returns 1 if it
+// was changed, or 0 if the setting doesn't exist, the value is out of range or the setting can't be
+// changed anymore
+int custom_mallopt(int param, int value) {
+  pthread_once(&config_once, init_config);
+  if (value < 0 || !set_option(param, (size_t) value)) {
+    return 0;
+  }
+  // Until the arenas are set up, the first thread to get one starts the background thread
+  if (param == CUSTOM_M_BACKGROUND_THREAD && num_arenas != 0) {
+    start_background_thread();
+  }
+  return 1;
+}
+
+void prof_init_from_env(void);
+
+// Set up the arenas. Unless a number is configured, the number of arenas scales with the number of
+// CPUs so that there are enough of them to go around when every CPU is running a thread that
+// allocates
+void init_arenas(void) {
+#ifdef HARDENED
+  // Headers and links are checked against the secret, so it has to be picked before any exist
+  if (getrandom(&heap_secret, sizeof(heap_secret), GRND_NONBLOCK) != sizeof(heap_secret)) {
+    heap_secret = (uintptr_t) monotonic_ns() ^ (uintptr_t) &heap_secret;
+  }
+#endif
+  pthread_once(&config_once, init_config);
+  num_nodes = count_nodes();
+  prof_init_from_env();
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t n = cpus > 0 ? (size_t) cpus * ARENAS_PER_CPU : 1;
+  if (arena_limit != 0) {
+    n = arena_limit;
+  }
+  // Every node gets the same number of arenas
+  n = (n + num_nodes - 1) / num_nodes * num_nodes;
+  num_arenas = n < MAX_ARENAS ? n : MAX_ARENAS / num_nodes * num_nodes;
+  for (size_t i = 0; i < num_arenas; i++) {
+    pthread_mutex_init(&arenas[i].lock, NULL);
+    arenas[i].index = (uint32_t) i;
+    arenas[i].node = (uint32_t) (i % num_nodes);
+    arenas[i].grow_size = HEAP_GROW_MIN;
+  }
+}
+
+void reclaim_thread_caches(void);
+void trace_fork_child(void);
+
+// Take every lock before the process forks, so that the child can't inherit a lock that another
+// thread was holding in the middle of changing what it protects. Starting the background thread can
+// allocate while holding its lock, so that comes first. Arena locks are never nested, and the stats
+// lock can be taken while holding one, so it comes after them
+void fork_prepare(void) {
+  pthread_mutex_lock(&background_lock);
+  pthread_mutex_lock(&tcache_lock);
+  for (size_t i = 0; i < num_arenas; i++) {
+    pthread_mutex_lock(&arenas[i].lock);
+  }
+  pthread_mutex_lock(&stats_lock);
+  pthread_mutex_lock(&prof_lock);
+  pthread_mutex_lock(&trace_lock);
+}
+
+// Let go of the locks taken by fork_prepare once the fork is done, in both the parent and the child
+void fork_release(void) {
+  pthread_mutex_unlock(&trace_lock);
+  pthread_mutex_unlock(&prof_lock);
+  pthread_mutex_unlock(&stats_lock);
+  for (size_t i = 0; i < num_arenas; i++) {
+    pthread_mutex_unlock(&arenas[i].lock);
+  }
+  pthread_mutex_unlock(&tcache_lock);
+  pthread_mutex_unlock(&background_lock);
+}
+
+// Let go of the locks in the child, which only has the thread that forked. The other threads are
+// gone, and the thread library hands their thread local storage to the child's new threads, so
+// their stats are retired and what their caches held goes back to the arenas. The child stops
+// tracing since the trace file belongs to the parent, and its first new thread restarts the
+// background thread
+void fork_child(void) {
+  background_running = false;
+  for (thread_stats_t *st = stats_threads; st != NULL; st = st->next) {
+    if (st != &stats) {
+      retire_stats(st);
+      st->registered = false;
+    }
+  }
+  stats_threads = stats.registered ? &stats : NULL;
+  stats.prev = NULL;
+  stats.next = NULL;
+  trace_fork_child();
+  fork_release();
+  reclaim_thread_caches();
+}
+
+void register_fork_handlers(void) {
+  pthread_atfork(fork_prepare, fork_release, fork_child);
+}
+
+// Get the calling thread's arena, assigning it the next one round robin if it doesn't have one yet.
+// The fork handlers are registered once the arena is set, since registering them might allocate
+arena_t *get_arena(void) {
+  if (thread_arena == NULL) {
+    pthread_once(&arenas_once, init_arenas);
+    size_t n = atomic_fetch_add_explicit(&next_arena, 1, memory_order_relaxed);
+    unsigned int cpu, node = 0;
+    if (num_nodes == 1 || getcpu(&cpu, &node) != 0 || node >= num_nodes) {
+      node = 0;
+    }
+    size_t i = node + n % (num_arenas / num_nodes) * num_nodes;
+    thread_arena = &arenas[i];
+    pthread_once(&fork_handlers_once, register_fork_handlers);
+    if (atomic_load_explicit(&background_thread, memory_order_relaxed)) {
+      start_background_thread();
+    }
+  }
+  return thread_arena;
+}
+
+// Get the arena which owns the given block, or NULL if the header doesn't name a valid arena
+arena_t *block_arena(header_t *block) {
+  assert(block != NULL);
+
+  size_t i = block->flags >> HDR_ARENA_SHIFT;
+  return i < num_arenas ? &arenas[i] : NULL;
+}
+
+#ifdef COMPACT_HEADERS
+// Get the check that a header at the given address has when it is intact
+uint16_t header_check(header_t *block) {
+  return (uint16_t) ((((uintptr_t) block ^ heap_secret) * UINT64_C(0x9E3779B97F4A7C15)) >> 48) ^
+      0xC0DE;
+}
+#else
+// Get the magic number that a default header at the given address holds. Hardened builds derive it
+// from the address and the heap secret instead of using MAGIC
+uint32_t header_magic(header_t *block) {
+#ifdef HARDENED
+  return (uint32_t) ((((uintptr_t) block ^ heap_secret) * UINT64_C(0x9E3779B97F4A7C15)) >> 32);
+#else
+  (void) block;
+  return MAGIC;
+#endif
+}
+#endif
+
+// Return true if the given header has its magic number, which means that it is probably a header
+bool header_intact(header_t *block) {
+#ifdef COMPACT_HEADERS
+  return block->check == header_check(block);
+#else
+  return block->magic == header_magic(block);
+#endif
+}
+
+// Mark the given header as a valid header, or as one that isn't valid anymore
+void seal_header(header_t *block, bool valid) {
+#ifdef COMPACT_HEADERS
+  block->check = valid ? header_check(block) : (uint16_t) ~header_check(block);
+#else
+  block->magic = valid ? header_magic(block) : ~header_magic(block);
+#endif
+}
+
+// Get the block after the given one in its segment, or NULL if it is the last one
+header_t *block_next(header_t *block) {
+#ifdef COMPACT_HEADERS
+  return block->prev_link & PREV_LAST ? NULL : (header_t *) ((char *) (block + 1) + block->dsize);
+#else
+  return block->next;
+#endif
+}
+
+// Get the block before the given one in its segment, or NULL if it is the first one
+header_t *block_prev(header_t *block) {
+#ifdef COMPACT_HEADERS
+  uint32_t units = block->prev_link & ~PREV_LAST;
+  return units == 0 ? NULL : (header_t *) ((char *) block - (size_t) units * CLASS_STEP);
+#else
+  return block->prev;
+#endif
+}
+
+// Set the block after the given one, which must start right after its data unless it is NULL
+void set_block_next(header_t *block, header_t *next) {
+#ifdef COMPACT_HEADERS
+  assert(next == NULL || (char *) next == (char *) (block + 1) + block->dsize);
+  block->prev_link = next == NULL ? block->prev_link | PREV_LAST : block->prev_link & ~PREV_LAST;
+#else
+  block->next = next;
+#endif
+}
+
+// Set the block before the given one, which must come before it in the same segment unless it is
+// NULL
+void set_block_prev(header_t *block, header_t *prev) {
+#ifdef COMPACT_HEADERS
+  uint32_t units = prev == NULL ? 0 : (uint32_t) (((char *) block - (char *) prev) / CLASS_STEP);
+  block->prev_link = (block->prev_link & PREV_LAST) | units;
+#else
+  block->prev = prev;
+#endif
+}
+
+// Get the bin links of the given free block
+free_links_t *block_links(header_t *block) {
+#ifdef COMPACT_HEADERS
+  return (free_links_t *) (block + 1);
+#else
+  return &block->links;
+#endif
+}
+
+// Get the start of the mapping that holds the given mapped block. Mappings start in the page that
+// the block's header is in, and the default header also keeps the start in its next link so that
+// it can be checked
+char *block_mapping(header_t *block) {
+#ifdef COMPACT_HEADERS
+  return (char *) ((uintptr_t) block & ~(page_size() - 1));
+#else
+  return (char *) block->next;
+#endif
+}
+
+// Set up the header of a mapped block whose mapping starts at map_start
+void init_mapped_header(header_t *block, char *map_start, size_t dsize) {
+  block->dsize = dsize;
+  block->flags = HDR_MMAPPED;
+#ifdef COMPACT_HEADERS
+  (void) map_start;
+  block->prev_link = PREV_LAST;
+#else
+  block->next = (header_t *) map_start;
+  block->prev = NULL;
+  block->links.next_free = NULL;
+  block->links.prev_free = NULL;
+#endif
+  seal_header(block, true);
+}
+
+// Insert a new block into the arena between the two given header pointers given the address of the
+// new block and the size of its data region
+void insert_block(arena_t *a, char *addr, size_t dsize, header_t *prev, header_t *next) {
+  assert(addr != NULL);
+  assert(a->segments != NULL);
+
+  header_t *block = (header_t *) addr;
+  block->dsize = dsize;
+  block->flags = (uint16_t) (a->index << HDR_ARENA_SHIFT);
+#ifdef COMPACT_HEADERS
+  block->prev_link = 0;
+#endif
+  seal_header(block, true);
+  set_block_next(block, next);
+  set_block_prev(block, prev);
+  if (prev != NULL) {
+    set_block_next(prev, block);
+  }
+  if (next != NULL) {
+    set_block_prev(next, block);
+  }
+}
+
+void heap_release(arena_t *a, header_t *block);
+
+// Prefer the arena's node for the pages of memory that the arena just got. Only whole pages can be
+// bound, and the program break might not be page aligned
+void bind_to_node(arena_t *a, char *start, size_t size) {
+  if (num_nodes == 1) {
+    return;
+  }
+  size_t page = page_size();
+  uintptr_t first = ((uintptr_t) start + page - 1) & ~(page - 1);
+  uintptr_t end = ((uintptr_t) start + size) & ~(page - 1);
+  if (first >= end) {
+    return;
+  }
+  unsigned long mask = 1UL << a->node;
+  syscall(SYS_mbind, first, end - first, MPOL_PREFERRED, &mask, MAX_NODES + 1, 0);
+  stat_add(STAT_MBIND_CALLS, 1);
+}
+
+// Get the size of the pieces that memory is given back to the OS in
+size_t purge_unit(void) {
+  return huge_pages ? HUGE_PAGE_SIZE : page_size();
+}
+
+// Ask for the whole huge pages in the given range to be backed by transparent huge pages, if huge
+// pages are turned on
+void advise_huge(char *start, size_t size) {
+  if (!huge_pages) {
+    return;
+  }
+  uintptr_t first = ((uintptr_t) start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  uintptr_t end = ((uintptr_t) start + size) & ~(HUGE_PAGE_SIZE - 1);
+  if (first < end) {
+    madvise((void *) first, (size_t) (end - first), MADV_HUGEPAGE);
+    stat_add(STAT_MADVISE_CALLS, 1);
+  }
+}
+
+// Reserve the heap region, aligned to a huge page. If the reservation fails the arenas grow with
+// sbrk and mmap instead
+void init_heap_region(void) {
+  size_t size = HEAP_REGION_SIZE + HUGE_PAGE_SIZE;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+  char *start = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  stat_add(STAT_MMAP_CALLS, 1);
+  if (start == MAP_FAILED) {
+    return;
+  }
+  char *aligned = (char *) (((uintptr_t) start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+  if (aligned > start) {
+    munmap(start, (size_t) (aligned - start));
+    stat_add(STAT_MUNMAP_CALLS, 1);
+  }
+  if (aligned + HEAP_REGION_SIZE < start + size) {
+    munmap(aligned + HEAP_REGION_SIZE, (size_t) (start + size - (aligned + HEAP_REGION_SIZE)));
+    stat_add(STAT_MUNMAP_CALLS, 1);
+  }
+  heap_region_end = aligned + HEAP_REGION_SIZE;
+  atomic_store_explicit(&heap_next, aligned, memory_order_relaxed);
+  heap_region = aligned;
+}
+
+// Return true if the given pointer is inside of the heap region
+bool in_heap_region(void *p) {
+  return (char *) p >= heap_region && (char *) p < heap_region_end;
+}
+
+// Take size bytes at the start of the free part of the heap region. Nothing is read through the
+// next free address, so it doesn't matter if the space there was taken and given back in between
+// reading it and swapping it. Returns NULL if the region ran out or couldn't be reserved
+char *heap_region_take(size_t size) {
+  pthread_once(&heap_region_once, init_heap_region);
+  if (heap_region == NULL) {
+    return NULL;
+  }
+  char *start = atomic_load_explicit(&heap_next, memory_order_relaxed);
+  do {
+    if (size > (size_t) (heap_region_end - start)) {
+      return NULL;
+    }
+  } while (!atomic_compare_exchange_weak_explicit(&heap_next, &start, start + size,
+      memory_order_relaxed, memory_order_relaxed));
+  return start;
+}
+
+// Take size bytes of the heap region that start at end, which is where a segment ends, so that the
+// segment can grow in place. Returns false if another arena took that space first or it would go
+// past the end of the region
+bool heap_region_extend(char *end, size_t size) {
+  if (size > (size_t) (heap_region_end - end)) {
+    return false;
+  }
+  return atomic_compare_exchange_strong_explicit(&heap_next, &end, end + size, memory_order_relaxed,
+      memory_order_relaxed);
+}
+
+// Get the number of bytes to grow the arena by when it needs at least the given number of bytes,
+// and double the arena's chunk size for next time
+size_t grow_chunk(arena_t *a, size_t need) {
+  size_t page = huge_pages ? HUGE_PAGE_SIZE : page_size();
+  need = (need + page - 1) & ~(page - 1);
+  size_t chunk = need > a->grow_size ? need : a->grow_size;
+  if (a->grow_size < HEAP_GROW_MAX) {
+    a->grow_size *= 2;
+  }
+  return chunk;
+}
+
+// Add a new segment to the arena with room for a block of bsize bytes and make it the newest one.
+// The segment comes from the heap region, or once that runs out the main arena takes it from the
+// program break and the others map it. Whatever space was left at the top of the previous segment
+// becomes a free block. Returns 0 on success and -1 on failure
+int add_segment(arena_t *a, size_t bsize) {
+  // The program break might not be aligned and a mapping might not be aligned to a huge page, so
+  // leave room to align the segment record
+  size_t align = huge_pages ? HUGE_PAGE_SIZE : ALIGNMENT;
+  size_t need = sizeof(segment_t) + bsize + (a->index == 0 || huge_pages ? align : 0);
+  size_t size = grow_chunk(a, need);
+  // The region is only reserved, so a segment's memory counts as mapped once it is handed out
+  char *start = heap_region_take(size);
+  if (start == NULL && a->index == 0) {
+    if (size > INTPTR_MAX) {
+      return -1;
+    }
+    start = sbrk((intptr_t) size);
+    stat_add(STAT_SBRK_CALLS, 1);
+    if (start == (void *) -1) {
+      return -1;
+    }
+  } else if (start == NULL) {
+    start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    stat_add(STAT_MMAP_CALLS, 1);
+    if (start == MAP_FAILED) {
+      return -1;
+    }
+    if (huge_pages) {
+      // Unmap the partial huge pages at both ends of the mapping
+      char *aligned = (char *) (((uintptr_t) start + align - 1) & ~(align - 1));
+      char *end = (char *) (((uintptr_t) start + size) & ~(align - 1));
+      if (aligned > start) {
+        munmap(start, (size_t) (aligned - start));
+        stat_add(STAT_MUNMAP_CALLS, 1);
+      }
+      if (end < start + size) {
+        munmap(end, (size_t) (start + size - end));
+        stat_add(STAT_MUNMAP_CALLS, 1);
+      }
+      start = aligned;
+      size = (size_t) (end - aligned);
+    }
+  }
+  stat_add(STAT_MAPPED, size);
+  bind_to_node(a, start, size);
+  advise_huge(start, size);
+  segment_t *old = a->segments;
+  if (old != NULL && (size_t) (old->end - a->top) >= sizeof(header_t) + CLASS_STEP) {
+    size_t dsize = ((size_t) (old->end - a->top) - sizeof(header_t)) & ~(CLASS_STEP - 1);
+    insert_block(a, a->top, dsize, a->last, NULL);
+    a->last = (header_t *) a->top;
+    heap_release(a, a->last);
+  }
+  segment_t *seg = (segment_t *) (((uintptr_t) start + align - 1) & ~(align - 1));
+  seg->end = start + size;
+  seg->next = old;
+  a->segments = seg;
+  a->top = (char *) (seg + 1);
+  a->purged = a->top;
+  // Blocks are only linked to the other blocks in their segment
+  a->last = NULL;
+  return 0;
+}
+
+// Make sure that there is room for a block of bsize bytes at the top of the arena, extending the
+// heap if necessary. Returns 0 on success and -1 on failure
+int expand_heap(arena_t *a, size_t bsize) {
+  segment_t *seg = a->segments;
+  if (seg != NULL && (size_t) (seg->end - a->top) >= bsize) {
+    return 0;
+  }
+  // A segment at the end of what has been taken out of the heap region can keep growing in place,
+  // as long as no other arena takes the space after it first
+  if (seg != NULL && in_heap_region(seg) &&
+      atomic_load_explicit(&heap_next, memory_order_relaxed) == seg->end) {
+    size_t expansion = grow_chunk(a, bsize - (size_t) (seg->end - a->top));
+    if (heap_region_extend(seg->end, expansion)) {
+      stat_add(STAT_MAPPED, expansion);
+      bind_to_node(a, seg->end, expansion);
+      advise_huge(seg->end, expansion);
+      seg->end += expansion;
+      return 0;
+    }
+  }
+  // The main arena can keep growing a segment from the program break in place, as long as nothing
+  // else has moved the program break since it was last extended
+  if (a->index == 0 && seg != NULL && !in_heap_region(seg) && sbrk(0) == seg->end) {
+    size_t expansion = grow_chunk(a, bsize - (size_t) (seg->end - a->top));
+    if (expansion > INTPTR_MAX) {
+      return -1;
+    }
+    void *res = sbrk((intptr_t) expansion);
+    stat_add(STAT_SBRK_CALLS, 1);
+    if (res == (void *) -1) {
+      return -1;
+    }
+    stat_add(STAT_MAPPED, expansion);
+    bind_to_node(a, seg->end, expansion);
+    advise_huge(seg->end, expansion);
+    seg->end += expansion;
+    return 0;
+  }
+  return add_segment(a, bsize);
+}
+
+// Move the top of the arena up to the given address after the space below it was handed out
+void advance_top(arena_t *a, char *new_top) {
+  a->top = new_top;
+  if (a->purged < new_top) {
+    a->purged = new_top;
+  }
+}
+
+void bin_remove(arena_t *a, header_t *block);
+
+// Merge any free blocks at the top of the arena into the unused space there, so that what comes
+// next can grow in place
+void merge_into_top(arena_t *a) {
+  while (a->last != NULL && (a->last->flags & HDR_FREE) &&
+      (char *) a->last + sizeof(header_t) + a->last->dsize == a->top) {
+    header_t *block = a->last;
+    bin_remove(a, block);
+    seal_header(block, false);
+    a->last = block_prev(block);
+    if (a->last != NULL) {
+      set_block_next(a->last, NULL);
+    }
+    a->top = (char *) block;
+  }
+}
+
+// Merge any free blocks at the top of the arena into the unused space there, then give the unused
+// space back to the OS if there is more than trim_threshold bytes of it. The pages are advised
+// away, and a segment at the end of the heap region gives its space back to the region too. The
+// main arena lowers the program break instead if its segment came from there and nothing else has
+// moved it
+void trim_heap(arena_t *a) {
+  merge_into_top(a);
+  segment_t *seg = a->segments;
+  if ((size_t) (seg->end - a->top) < atomic_load_explicit(&trim_threshold, memory_order_relaxed)) {
+    return;
+  }
+  // Keep HEAP_GROW_MIN bytes around so that small fluctuations don't keep growing and shrinking
+  size_t page = purge_unit();
+  uintptr_t keep_end = ((uintptr_t) a->top + HEAP_GROW_MIN + page - 1) & ~(page - 1);
+  if (keep_end >= (uintptr_t) seg->end) {
+    return;
+  }
+  size_t release = (size_t) ((uintptr_t) seg->end - keep_end);
+  if (a->index == 0 && !in_heap_region(seg) && sbrk(0) == seg->end) {
+    stat_add(STAT_SBRK_CALLS, 1);
+    if (sbrk(-(intptr_t) release) != (void *) -1) {
+      stat_add(STAT_MAPPED, -release);
+      seg->end -= release;
+      if (a->purged > seg->end) {
+        a->purged = seg->end;
+      }
+    }
+    return;
+  }
+  if (keep_end < (uintptr_t) a->purged) {
+    madvise((void *) keep_end, (size_t) ((uintptr_t) a->purged - keep_end), MADV_DONTNEED);
+    stat_add(STAT_MADVISE_CALLS, 1);
+    a->purged = (char *) keep_end;
+  }
+  // The pages have to be gone before the space is given back, since another arena can take it
+  // as soon as it is
+  char *end = seg->end;
+  if (in_heap_region(seg) && atomic_compare_exchange_strong_explicit(&heap_next, &end,
+      (char *) keep_end, memory_order_relaxed, memory_order_relaxed)) {
+    stat_add(STAT_MAPPED, -release);
+    seg->end = (char *) keep_end;
+  }
+}
+
+// Get the dirty list link of a free block, which goes past where the free list links go in either
+// kind of header
+dirty_t *block_dirty(header_t *block) {
+  return (dirty_t *) ((char *) (block + 1) + sizeof(free_links_t));
+}
+
+// Get the whole pages inside of a free block that can be given back to the OS, which leaves the
+// header and both kinds of links alone since the block stays in its bin. Returns the number of
+// bytes in them and sets start to the first one
+size_t block_purge_range(header_t *block, char **start) {
+  size_t page = purge_unit();
+  uintptr_t first = ((uintptr_t) (block_dirty(block) + 1) + page - 1) & ~(page - 1);
+  uintptr_t end = ((uintptr_t) (block + 1) + block->dsize) & ~(page - 1);
+  *start = (char *) first;
+  return first < end ? (size_t) (end - first) : 0;
+}
+
+// Put memory on the newer end of one of an arena's decay lists
+void decay_push(arena_t *a, size_t i, dirty_t *d) {
+  decay_list_t *list = &a->decay[i];
+  d->list = (uint8_t) (i + 1);
+  d->older = mangle(&d->older, list->newest);
+  d->newer = mangle(&d->newer, NULL);
+  if (list->newest != NULL) {
+    list->newest->newer = mangle(&list->newest->newer, d);
+  } else {
+    list->oldest = d;
+  }
+  list->newest = d;
+  list->bytes += d->size;
+  stat_add(STAT_DIRTY_BYTES + i, d->size);
+}
+
+// Take memory off of the decay list that it is on
+void decay_remove(arena_t *a, dirty_t *d) {
+  size_t i = d->list - 1;
+  decay_list_t *list = &a->decay[i];
+  dirty_t *older = unmangle_link(&d->older, d->older);
+  dirty_t *newer = unmangle_link(&d->newer, d->newer);
+  if (older != NULL) {
+    older->newer = mangle(&older->newer, newer);
+  } else {
+    list->oldest = newer;
+  }
+  if (newer != NULL) {
+    newer->older = mangle(&newer->older, older);
+  } else {
+    list->newest = older;
+  }
+  list->bytes -= d->size;
+  d->list = 0;
+  stat_add(STAT_DIRTY_BYTES + i, -d->size);
+}
+
+// Give the oldest memory on a decay list back to the OS. Dirty memory is advised with MADV_FREE and
+// moves on to the muzzy list, unless MADV_FREE isn't supported or memory is given back right away,
+// and muzzy memory is advised with MADV_DONTNEED and is done
+void purge_oldest(arena_t *a, size_t i) {
+  dirty_t *d = a->decay[i].oldest;
+  decay_remove(a, d);
+#ifdef MADV_FREE
+  if (i == DECAY_DIRTY && atomic_load_explicit(&decay_time, memory_order_relaxed) != 0) {
+    stat_add(STAT_MADVISE_CALLS, 1);
+    if (madvise(d->start, d->size, MADV_FREE) == 0) {
+      decay_push(a, DECAY_MUZZY, d);
+      return;
+    }
+  }
+#endif
+  madvise(d->start, d->size, MADV_DONTNEED);
+  stat_add(STAT_MADVISE_CALLS, 1);
+  if (!d->slab) {
+    ((header_t *) ((char *) d - sizeof(free_links_t)) - 1)->flags &= ~HDR_DECAYING;
+  }
+}
+
+void transfer_flush(arena_t *a);
+void drain_remote_frees(arena_t *a);
+
+// Purge the memory of an arena that has outstayed the decay curve, and trim the top of the arena.
+// Of the memory added to a list i epochs ago, a share of 1 - smoothstep((i + 1) / DECAY_STEPS) can
+// stay, so purging starts out slowly, speeds up and eases off again. This only does anything once
+// an epoch, and does everything right away if the decay time is 0. The arena's lock must be held
+void decay_arena(arena_t *a) {
+  size_t decay = atomic_load_explicit(&decay_time, memory_order_relaxed);
+  size_t steps = DECAY_STEPS;
+  if (decay != 0) {
+    uint64_t epoch = (uint64_t) decay * 1000000 / DECAY_STEPS;
+    uint64_t now = monotonic_ns();
+    if (now - a->decay_epoch < epoch) {
+      return;
+    }
+    if ((now - a->decay_epoch) / epoch < DECAY_STEPS) {
+      steps = (size_t) ((now - a->decay_epoch) / epoch);
+    }
+    a->decay_epoch = now;
+    transfer_flush(a);
+    drain_remote_frees(a);
+  }
+  for (size_t i = 0; i < NUM_DECAY_LISTS; i++) {
+    decay_list_t *list = &a->decay[i];
+    // Age everything by the epochs that went by, and count what was added since as the newest
+    memmove(list->added + steps, list->added, (DECAY_STEPS - steps) * sizeof(size_t));
+    memset(list->added, 0, steps * sizeof(size_t));
+    list->added[0] = list->bytes > list->epoch_bytes ? list->bytes - list->epoch_bytes : 0;
+    double limit = 0;
+    for (size_t j = 0; j < DECAY_STEPS && decay != 0; j++) {
+      double x = (double) (j + 1) / DECAY_STEPS;
+      limit += (double) list->added[j] * (1 - x * x * (3 - 2 * x));
+    }
+    while (list->oldest != NULL && (double) list->bytes > limit) {
+      purge_oldest(a, i);
+    }
+    list->epoch_bytes = list->bytes;
+  }
+  if (a->segments != NULL) {
+    trim_heap(a);
+  }
+}
+
+// Count a free given back to an arena, purging it every DECAY_TICKS of them. The arena's lock must
+// be held
+void decay_tick(arena_t *a) {
+  if (atomic_load_explicit(&decay_time, memory_order_relaxed) == 0 || a->decay_ticks-- == 0) {
+    a->decay_ticks = DECAY_TICKS;
+    decay_arena(a);
+  }
+}
+
+// Return true if the given pointer is within one of the arena's segments, between the start of the
+// segment's blocks and the last possible place a header could go
+bool in_arena(arena_t *a, header_t *hptr) {
+  for (segment_t *seg = a->segments; seg != NULL; seg = seg->next) {
+    if ((char *) hptr >= (char *) (seg + 1) && (char *) hptr <= seg->end - sizeof(header_t)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Check if the given header pointer is a valid block of the given arena by checking its location
+// and magic number, and that its neighbors in the arena link back to it. NULL is special here since
+// it will cause any for loops to break, so a NULL header is valid
+bool valid_header(arena_t *a, header_t *hptr) {
+  if (hptr == NULL) {
+    return true;
+  }
+  if (!in_arena(a, hptr) || !header_intact(hptr) || block_arena(hptr) != a) {
+    return false;
+  }
+  // The neighbors are checked too, since an overflow out of a block runs into the next header
+  header_t *next = block_next(hptr);
+  if (next != NULL && (!in_arena(a, next) || !header_intact(next) || block_prev(next) != hptr)) {
+    return false;
+  }
+  header_t *prev = block_prev(hptr);
+  if (prev != NULL && (!in_arena(a, prev) || !header_intact(prev) || block_next(prev) != hptr)) {
+    return false;
+  }
+  return true;
+}
+
+// Push a newly freed block onto the front of the bin for its size
+void bin_push(arena_t *a, header_t *block) {
+  assert(block != NULL);
+
+  size_t i = free_bin_index(block->dsize);
+  block->flags |= HDR_FREE;
+  free_links_t *links = block_links(block);
+  links->next_free = mangle(&links->next_free, a->bins[i]);
+  links->prev_free = mangle(&links->prev_free, NULL);
+  if (a->bins[i] != NULL) {
+    free_links_t *next = block_links(a->bins[i]);
+    next->prev_free = mangle(&next->prev_free, block);
+  }
+  a->bins[i] = block;
+  a->binmap[i / 64] |= (uint64_t) 1 << (i % 64);
+  a->binmap_summary |= (uint64_t) 1 << (i / 64);
+  // Blocks with pages that can be given back wait for that on the dirty list
+  char *start;
+  size_t size = block_purge_range(block, &start);
+  if (size != 0) {
+    dirty_t *d = block_dirty(block);
+    d->start = start;
+    d->size = size;
+    d->slab = false;
+    decay_push(a, DECAY_DIRTY, d);
+    block->flags |= HDR_DECAYING;
+  }
+}
+
+// Take a free block out of its bin
+void bin_remove(arena_t *a, header_t *block) {
+  assert(block != NULL);
+  assert(block->flags & HDR_FREE);
+
+  free_links_t *links = block_links(block);
+  header_t *next_free = unmangle_link(&links->next_free, links->next_free);
+  header_t *prev_free = unmangle_link(&links->prev_free, links->prev_free);
+  if (prev_free != NULL) {
+    free_links_t *prev = block_links(prev_free);
+    prev->next_free = mangle(&prev->next_free, next_free);
+  } else {
+    size_t i = free_bin_index(block->dsize);
+    a->bins[i] = next_free;
+    if (a->bins[i] == NULL) {
+      a->binmap[i / 64] &= ~((uint64_t) 1 << (i % 64));
+      if (a->binmap[i / 64] == 0) {
+        a->binmap_summary &= ~((uint64_t) 1 << (i / 64));
+      }
+    }
+  }
+  if (next_free != NULL) {
+    free_links_t *next = block_links(next_free);
+    next->prev_free = mangle(&next->prev_free, prev_free);
+  }
+  if (block->flags & HDR_DECAYING) {
+    decay_remove(a, block_dirty(block));
+  }
+  block->flags &= ~(HDR_FREE | HDR_DECAYING);
+}
+
+// Get the index of the first bin from bin i on that isn't empty, or NUM_FREE_BINS if they all are
+size_t next_bin(arena_t *a, size_t i) {
+  if (i >= NUM_FREE_BINS) {
+    return NUM_FREE_BINS;
+  }
+  uint64_t word = a->binmap[i / 64] & (~(uint64_t) 0 << (i % 64));
+  if (word != 0) {
+    return (i & ~(size_t) 63) + (size_t) __builtin_ctzll(word);
+  }
+  uint64_t words = a->binmap_summary & (~(uint64_t) 1 << (i / 64));
+  if (words == 0) {
+    return NUM_FREE_BINS;
+  }
+  size_t w = (size_t) __builtin_ctzll(words);
+  return w * 64 + (size_t) __builtin_ctzll(a->binmap[w]);
+}
+
+// Find a free block that can hold dsize bytes of data and take it out of its bin. The first block
+// of the bin that dsize falls in is tried first, since it is often one that was freed by an
+// allocation of the same size. Otherwise the block is the first one in the first bin that isn't
+// empty out of the bins where every block is big enough, so no more than two blocks are ever looked
+// at. Returns NULL if no free block fits, or -1 if the heap is corrupted
+header_t *find_opening(arena_t *a, size_t dsize) {
+  stat_add(STAT_SEARCHES, 1);
+  header_t *block = a->bins[free_bin_index(dsize)];
+  if (block != NULL) {
+    stat_add(STAT_SEARCH_STEPS, 1);
+    if (!valid_header(a, block)) {
+      return (void *) -1;
+    }
+  }
+  if (block == NULL || block->dsize < dsize) {
+    size_t i = next_bin(a, fit_bin_index(dsize));
+    if (i == NUM_FREE_BINS) {
+      return NULL;
+    }
+    stat_add(STAT_SEARCH_STEPS, 1);
+    block = a->bins[i];
+  }
+  if (!valid_header(a, block) || !(block->flags & HDR_FREE)) {
+    return (void *) -1;
+  }
+  bin_remove(a, block);
+  return block;
+}
+
+// Return true if the block after the given one is free and the two can be merged without going
+// over MAX_HEAP_DSIZE
+bool next_is_free(header_t *block) {
+  header_t *next = block_next(block);
+  return next != NULL && (next->flags & HDR_FREE) &&
+      next->dsize <= MAX_HEAP_DSIZE - sizeof(header_t) - block->dsize;
+}
+
+// Merge the block after the given one into it, taking it out of its bin first if it is free since
+// it is going away. The arena's lock must be held
+void absorb_next(arena_t *a, header_t *block) {
+  header_t *next = block_next(block);
+  header_t *after = block_next(next);
+  if (next->flags & HDR_FREE) {
+    bin_remove(a, next);
+  }
+  block->dsize += sizeof(header_t) + next->dsize;
+  set_block_next(block, after);
+  if (after != NULL) {
+    set_block_prev(after, block);
+  }
+  if (a->last == next) {
+    a->last = block;
+  }
+  seal_header(next, false);
+}
+
+// Merge a block that is being freed with the free blocks right next to it in the same segment, and
+// return the header of the merged block. The arena's lock must be held
+header_t *coalesce(arena_t *a, header_t *block) {
+  if (next_is_free(block)) {
+    absorb_next(a, block);
+  }
+  header_t *prev = block_prev(block);
+  if (prev != NULL && (prev->flags & HDR_FREE) &&
+      block->dsize <= MAX_HEAP_DSIZE - sizeof(header_t) - prev->dsize) {
+    bin_remove(a, prev);
+    absorb_next(a, prev);
+    block = prev;
+  }
+  return block;
+}
+
+// Give a block back to the given arena by merging it with its free neighbors and putting it in its
+// bin. A block at the top of the arena is merged into the unused space there instead, which the
+// arena trims the next time it purges. The arena's lock must be held
+void heap_release(arena_t *a, header_t *block) {
+  if (!valid_header(a, block)) {
+    heap_error("Freed 0 bytes (Heap corrupted)");
+    return;
+  }
+  block = coalesce(a, block);
+  bin_push(a, block);
+  if (block == a->last && (char *) block + sizeof(header_t) + block->dsize == a->top) {
+    merge_into_top(a);
+  }
+  decay_tick(a);
+}
+
+// Shrink an allocated block down to dsize bytes of data, splitting whatever is left off into a new
+// free block if it has room for at least SPLIT_MIN bytes of data. The arena's lock must be held
+void split_block(arena_t *a, header_t *block, size_t dsize) {
+  if (block->dsize - dsize < sizeof(header_t) + SPLIT_MIN) {
+    return;
+  }
+  char *rest = (char *) (block + 1) + dsize;
+  size_t rest_dsize = block->dsize - dsize - sizeof(header_t);
+  header_t *next = block_next(block);
+  block->dsize = dsize;
+  insert_block(a, rest, rest_dsize, block, next);
+  if (a->last == block) {
+    a->last = (header_t *) rest;
+  }
+  heap_release(a, (header_t *) rest);
+}
+
+// Try to resize an allocated block to dsize bytes of data without moving it. Shrinking splits off
+// the end of the block, and growing takes space from the free block right after it or from the top
+// of the arena. Returns true if the block now has room for dsize bytes. The arena's lock must be
+// held
+bool heap_resize(arena_t *a, header_t *block, size_t dsize) {
+  if (dsize <= block->dsize) {
+    split_block(a, block, dsize);
+    return true;
+  }
+  if (dsize > MAX_HEAP_DSIZE) {
+    return false;
+  }
+  char *block_end = (char *) (block + 1) + block->dsize;
+  if (block_next(block) == NULL && block_end == a->top) {
+    // Adding a segment would leave the block behind in the old one, so only growing the current
+    // segment in place helps
+    size_t need = dsize - block->dsize;
+    if (expand_heap(a, need) == -1 || a->top != block_end) {
+      return false;
+    }
+    advance_top(a, block_end + need);
+    block->dsize = dsize;
+    return true;
+  }
+  if (next_is_free(block) && block->dsize + sizeof(header_t) + block_next(block)->dsize >= dsize) {
+    absorb_next(a, block);
+    split_block(a, block, dsize);
+    return true;
+  }
+  return false;
+}
+
+// Allocate a block with dsize bytes of data from the given arena, either by reusing a free block
+// from the bins or by adding it to the top of the arena. If dirty isn't NULL, it is set to the
+// number of bytes at the start of the block's data that might not be zero. Memory above the purged
+// mark at the top of the arena has never been touched since the OS handed it over, so it is still
+// zero. The arena's lock must be held. Returns the header of the new block, or NULL if the
+// allocation failed
+header_t *heap_alloc(arena_t *a, size_t dsize, size_t *dirty) {
+  if (dsize > MAX_HEAP_DSIZE) {
+    debug_printf("Malloc 0 bytes (Too big for the heap)\n");
+    return NULL;
+  }
+  // Size of the region needed to store this allocation
+  size_t bsize = sizeof(header_t) + dsize;
+  // Reuse a free block from the bins if there is one that fits
+  header_t *block = find_opening(a, dsize);
+  if (block == (void *) -1) {
+    heap_error("Malloc 0 bytes (Heap corrupted)");
+    return NULL;
+  }
+  if (block == NULL) {
+    // Otherwise the block goes at the top of the arena, so try to extend the heap to accomodate it
+    if (expand_heap(a, bsize) == -1) {
+      debug_printf("Malloc 0 bytes (Heap expansion failed)\n");
+      return NULL;
+    }
+    // Insert this new block into the linked list
+    insert_block(a, a->top, dsize, a->last, NULL);
+    block = (header_t *) a->top;
+    a->last = block;
+    if (dirty != NULL) {
+      char *data = (char *) (block + 1);
+      *dirty = a->purged > data ? (size_t) (a->purged - data) : 0;
+      *dirty = *dirty < dsize ? *dirty : dsize;
+    }
+    advance_top(a, a->top + bsize);
+  } else {
+    split_block(a, block, dsize);
+    if (dirty != NULL) {
+      *dirty = block->dsize;
+    }
+  }
+  return block;
+}
+
+
+// Reserve the slab region and its metadata table. Nothing is backed by memory until it is used. If
+// the reservation fails small objects just come from the arenas like everything else
+void init_slab_region(void) {
+  size_t table_size = SLAB_REGION_SIZE / SLAB_SIZE * sizeof(slab_t);
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+  char *region = mmap(NULL, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+  stat_add(STAT_MMAP_CALLS, 1);
+  if (region == MAP_FAILED) {
+    return;
+  }
+  slab_t *table = mmap(NULL, table_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  stat_add(STAT_MMAP_CALLS, 1);
+  if (table == MAP_FAILED) {
+    munmap(region, SLAB_REGION_SIZE);
+    stat_add(STAT_MUNMAP_CALLS, 1);
+    return;
+  }
+  advise_huge(region, SLAB_REGION_SIZE);
+  slab_table = table;
+  slab_region_end = region + SLAB_REGION_SIZE;
+  slab_region = region;
+}
+
+// Return true if the given pointer is inside of the slab region
+bool in_slab_region(void *p) {
+  return (char *) p >= slab_region && (char *) p < slab_region_end;
+}
+
+// Get the metadata of the slab that the given pointer in the slab region belongs to
+slab_t *slab_of(void *p) {
+  return &slab_table[(size_t) ((char *) p - slab_region) >> SLAB_SHIFT];
+}
+
+// Get the address of the first object in the given slab
+char *slab_start(slab_t *slab) {
+  return slab_region + ((size_t) (slab - slab_table) << SLAB_SHIFT);
+}
+
+// Add a slab to the front of a doubly linked list of slabs
+void slab_list_push(slab_t **list, slab_t *slab) {
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list != NULL) {
+    (*list)->prev = slab;
+  }
+  *list = slab;
+}
+
+// Take a slab out of the doubly linked list of slabs that it is in
+void slab_list_remove(slab_t **list, slab_t *slab) {
+  if (slab->prev != NULL) {
+    slab->prev->next = slab->next;
+  } else {
+    *list = slab->next;
+  }
+  if (slab->next != NULL) {
+    slab->next->prev = slab->prev;
+  }
+  slab->next = NULL;
+  slab->prev = NULL;
+}
+
+// Get a slab to hold objects of size class c for the arena, either one of its empty slabs or a new
+// one from the slab region, and make it the arena's first slab for the class. The arena's lock must
+// be held. Returns NULL if there are no slabs left
+slab_t *slab_create(arena_t *a, size_t c) {
+  slab_t *slab = a->empty_slabs;
+  if (slab != NULL) {
+    slab_list_remove(&a->empty_slabs, slab);
+    if (slab->dirty.list != 0) {
+      decay_remove(a, &slab->dirty);
+    }
+  } else {
+    pthread_once(&slab_region_once, init_slab_region);
+    if (slab_region == NULL) {
+      return NULL;
+    }
+    size_t i = atomic_fetch_add_explicit(&slab_next, 1, memory_order_relaxed);
+    if (i >= SLAB_REGION_SIZE / SLAB_SIZE) {
+      return NULL;
+    }
+    slab = &slab_table[i];
+    // The region is only reserved, so a new slab's memory counts as mapped once it is handed out
+    stat_add(STAT_MAPPED, SLAB_SIZE);
+  }
+  slab->magic = SLAB_MAGIC;
+  slab->size = (uint16_t) ((c + 1) * CLASS_STEP);
+  slab->capacity = (uint16_t) (SLAB_SIZE / slab->size);
+  slab->nfree = slab->capacity;
+  slab->arena = (uint16_t) a->index;
+  for (size_t w = 0; w < SLAB_BITMAP_WORDS; w++) {
+    size_t first = w * 64;
+    if (first >= slab->capacity) {
+      slab->bitmap[w] = ~(uint64_t) 0;
+    } else if (slab->capacity - first >= 64) {
+      slab->bitmap[w] = 0;
+    } else {
+      slab->bitmap[w] = ~(uint64_t) 0 << (slab->capacity - first);
+    }
+  }
+  slab_list_push(&a->slabs[c], slab);
+  return slab;
+}
+
+// Allocate an object of size class c from one of the arena's slabs. The arena's lock must be held.
+// Returns NULL if there are no slabs left
+void *slab_alloc(arena_t *a, size_t c) {
+  slab_t *slab = a->slabs[c];
+  if (slab == NULL) {
+    slab = slab_create(a, c);
+    if (slab == NULL) {
+      return NULL;
+    }
+  }
+  // Take the first free slot, and once the slab is full it doesn't need to be found anymore
+  size_t w = 0;
+  while (slab->bitmap[w] == ~(uint64_t) 0) {
+    w++;
+  }
+  size_t bit = (size_t) __builtin_ctzll(~slab->bitmap[w]);
+  slab->bitmap[w] |= (uint64_t) 1 << bit;
+  if (--slab->nfree == 0) {
+    slab_list_remove(&a->slabs[c], slab);
+  }
+  return slab_start(slab) + (w * 64 + bit) * slab->size;
+}
+
+// Check that the given pointer is the start of an object in a slab that is in use, and return the
+// slab if it is or NULL if it isn't
+slab_t *valid_slab_object(void *p) {
+  slab_t *slab = slab_of(p);
+  if (slab->magic != SLAB_MAGIC || (size_t) ((char *) p - slab_start(slab)) % slab->size != 0) {
+    return NULL;
+  }
+  return slab;
+}
+
+// Get the number of bytes of data that the allocated object at p has room for
+size_t usable_size(void *p) {
+  if (in_slab_region(p)) {
+    return slab_of(p)->size;
+  }
+  return ((header_t *) p - 1)->dsize;
+}
+
+// Give an object back to the slab that it came from in the given arena. A slab that becomes empty
+// can be reused for any size class. The arena's lock must be held
+void slab_release(arena_t *a, void *p) {
+  slab_t *slab = valid_slab_object(p);
+  if (slab == NULL || slab->arena != a->index) {
+    heap_error("Freed 0 bytes (Heap corrupted)");
+    return;
+  }
+  size_t slot = (size_t) ((char *) p - slab_start(slab)) / slab->size;
+  uint64_t bit = (uint64_t) 1 << (slot % 64);
+  if (!(slab->bitmap[slot / 64] & bit)) {
+    heap_error("Freed 0 bytes (Double free)");
+    return;
+  }
+  slab->bitmap[slot / 64] &= ~bit;
+  size_t c = slab->size / CLASS_STEP - 1;
+  if (++slab->nfree == 1) {
+    slab_list_push(&a->slabs[c], slab);
+  }
+  if (slab->nfree == slab->capacity) {
+    slab_list_remove(&a->slabs[c], slab);
+    slab_list_push(&a->empty_slabs, slab);
+    // Slabs are smaller than a huge page, so they keep their memory when huge pages are used
+    if (!huge_pages) {
+      slab->dirty.start = slab_start(slab);
+      slab->dirty.size = SLAB_SIZE;
+      slab->dirty.slab = true;
+      decay_push(a, DECAY_DIRTY, &slab->dirty);
+    }
+  }
+  decay_tick(a);
+}
+
+
+// Allocate a block with dsize bytes of data aligned to the given power of two alignment from the
+// given arena. The block is taken with enough slack to find an aligned spot in it, and the space in
+// front of that spot and after the data are split off into free blocks so that the alignment
+// doesn't waste any more than a header's worth of memory. The arena's lock must be held. Returns
+// the header of the new block, or NULL if the allocation failed
+header_t *heap_alloc_aligned(arena_t *a, size_t dsize, size_t alignment) {
+  size_t min_block = sizeof(header_t) + CLASS_STEP;
+  if (dsize > SIZE_MAX - alignment - min_block) {
+    return NULL;
+  }
+  header_t *block = heap_alloc(a, dsize + alignment + min_block, NULL);
+  if (block == NULL) {
+    return NULL;
+  }
+  // The space in front of the aligned spot has to be empty or big enough to be a block of its own
+  char *data = (char *) (block + 1);
+  char *aligned = (char *) (((uintptr_t) data + alignment - 1) & ~(alignment - 1));
+  if (aligned != data && (size_t) (aligned - data) < min_block) {
+    aligned += alignment;
+  }
+  if (aligned != data) {
+    header_t *front = block;
+    header_t *next = block_next(front);
+    size_t total = front->dsize;
+    block = (header_t *) (aligned - sizeof(header_t));
+    front->dsize = (size_t) ((char *) block - data);
+    insert_block(a, (char *) block, total - front->dsize - sizeof(header_t), front, next);
+    if (a->last == front) {
+      a->last = block;
+    }
+    heap_release(a, front);
+  }
+  split_block(a, block, dsize);
+  return block;
+}
+
+// Map a block with room for at least dsize bytes of data on its own, with its data aligned to the
+// given power of two alignment. The whole pages before the header and after the data that the
+// alignment didn't need are unmapped again. Returns the header of the new block, or NULL if the
+// mapping failed
+header_t *mmap_alloc(size_t dsize, size_t alignment) {
+  size_t page = page_size();
+  size_t guard = guard_size();
+  size_t extra = alignment > ALIGNMENT ? alignment : 0;
+  if (dsize > SIZE_MAX - sizeof(header_t) - page - extra - guard) {
+    return NULL;
+  }
+  size_t size = ((sizeof(header_t) + dsize + extra + page - 1) & ~(page - 1)) + guard;
+  char *start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  stat_add(STAT_MMAP_CALLS, 1);
+  if (start == MAP_FAILED) {
+    debug_printf("Malloc 0 bytes (Mapping failed)\n");
+    return NULL;
+  }
+  char *end = start + size;
+  uintptr_t data = ((uintptr_t) start + sizeof(header_t) + alignment - 1) & ~(alignment - 1);
+  header_t *block = (header_t *) (data - sizeof(header_t));
+  char *map_start = (char *) ((uintptr_t) block & ~(page - 1));
+  char *map_end = (char *) ((data + dsize + page - 1) & ~(page - 1));
+  if (map_start > start) {
+    munmap(start, (size_t) (map_start - start));
+    stat_add(STAT_MUNMAP_CALLS, 1);
+  }
+  if (map_end + guard < end) {
+    munmap(map_end + guard, (size_t) (end - map_end - guard));
+    stat_add(STAT_MUNMAP_CALLS, 1);
+  }
+  if (guard != 0) {
+    mprotect(map_end, guard, PROT_NONE);
+  }
+  stat_add(STAT_MAPPED, (size_t) (map_end - map_start));
+  stat_add(STAT_DIRECT_MAPPED, (size_t) (map_end - map_start));
+  // The block gets the rest of the mapping, which is at least as large as what was asked for
+  init_mapped_header(block, map_start, (size_t) (map_end - (char *) data));
+  return block;
+}
+
+// Return true if the given mapped block's mapping starts in the page that its header is in
+bool valid_mapping(header_t *block) {
+  char *map_start = block_mapping(block);
+  return ((uintptr_t) map_start & (page_size() - 1)) == 0 && map_start <= (char *) block &&
+      (size_t) ((char *) block - map_start) < page_size();
+}
+
+// Resize a mapped block's mapping so that it has room for dsize bytes of data, letting the kernel
+// move it if it can't grow where it is. The block's offset into its first page is kept, so its
+// data stays aligned to at least ALIGNMENT. A guard page moves along with the mapping, and has to
+// be made accessible for that since a single mremap can't span mappings with different protections.
+// Returns the header of the block, which might have moved, or NULL if the mapping couldn't be
+// resized
+header_t *mmap_resize(header_t *block, size_t dsize) {
+  size_t page = page_size();
+  size_t guard = guard_size();
+  char *map_start = block_mapping(block);
+  size_t offset = (size_t) ((char *) block - map_start);
+  if (dsize > SIZE_MAX - offset - sizeof(header_t) - page - guard) {
+    return NULL;
+  }
+  size_t old_size = offset + sizeof(header_t) + block->dsize;
+  size_t new_size = (offset + sizeof(header_t) + dsize + page - 1) & ~(page - 1);
+  if (new_size == old_size) {
+    return block;
+  }
+  if (guard != 0) {
+    mprotect(map_start + old_size, guard, PROT_READ | PROT_WRITE);
+  }
+  char *start = mremap(map_start, old_size + guard, new_size + guard, MREMAP_MAYMOVE);
+  stat_add(STAT_MREMAP_CALLS, 1);
+  if (start == MAP_FAILED) {
+    if (guard != 0) {
+      mprotect(map_start + old_size, guard, PROT_NONE);
+    }
+    return NULL;
+  }
+  if (guard != 0) {
+    mprotect(start + new_size, guard, PROT_NONE);
+  }
+  // This wraps around when the mapping shrinks, which takes the difference away
+  stat_add(STAT_MAPPED, new_size - old_size);
+  stat_add(STAT_DIRECT_MAPPED, new_size - old_size);
+  block = (header_t *) (start + offset);
+  init_mapped_header(block, start, new_size - offset - sizeof(header_t));
+  return block;
+}
+
+// Raise the thresholds to fit a mapped block of dsize bytes that is being freed, unless they were
+// set by hand. Racing threads can each store a different size, which only means that the threshold
+// is raised a little less than it could have been
+void raise_thresholds(size_t dsize) {
+  if (atomic_load_explicit(&thresholds_fixed, memory_order_relaxed) || dsize > MMAP_THRESHOLD_MAX ||
+      dsize > MAX_HEAP_DSIZE ||
+      dsize <= atomic_load_explicit(&mmap_threshold, memory_order_relaxed)) {
+    return;
+  }
+  atomic_store_explicit(&mmap_threshold, dsize, memory_order_relaxed);
+  atomic_store_explicit(&trim_threshold, 2 * dsize, memory_order_relaxed);
+  debug_printf("Raised the mmap threshold to %zu bytes\n", dsize);
+}
+
+// Give a mapped block back to the OS
+void mmap_release(header_t *block) {
+  char *map_start = block_mapping(block);
+  size_t size = (size_t) ((char *) (block + 1) + block->dsize - map_start);
+  munmap(map_start, size + guard_size());
+  stat_add(STAT_MUNMAP_CALLS, 1);
+  stat_add(STAT_MAPPED, -size);
+  stat_add(STAT_DIRECT_MAPPED, -size);
+}
+
+// Get the arena that a small object which is known to be valid came from
+arena_t *object_arena(void *p) {
+  if (in_slab_region(p)) {
+    return &arenas[slab_of(p)->arena];
+  }
+  return block_arena((header_t *) ((char *) p - sizeof(header_t)));
+}
+
+// Give a cached object back to the arena that it came from. The arena's lock must be held
+void release_cached(arena_t *a, void *p) {
+  if (in_slab_region(p)) {
+    slab_release(a, p);
+  } else {
+    header_t *block = (header_t *) ((char *) p - sizeof(header_t));
+    block->flags &= ~HDR_CACHED;
+    heap_release(a, block);
+  }
+}
+
+// Get the entry after the given one in a cache bin or queue of remote frees
+tcache_entry_t *entry_next(tcache_entry_t *entry) {
+  return unmangle_link(&entry->next, entry->next);
+}
+
+// Link the given entry of a cache bin or queue of remote frees to the next one
+void set_entry_next(tcache_entry_t *entry, tcache_entry_t *next) {
+  entry->next = mangle(&entry->next, next);
+}
+
+// Mark an entry with the cache or queue that it is on, or NULL for neither. The key is mangled like
+// the links, so that freed memory that happens to hold such an address isn't taken for an entry
+void set_entry_key(tcache_entry_t *entry, const void *key) {
+  entry->key = mangle(&entry->key, key);
+}
+
+// Return true if the given entry is marked with the given key
+bool entry_has_key(tcache_entry_t *entry, const void *key) {
+  return entry->key == mangle(&entry->key, key);
+}
+
+// Give a list of cached objects back to the arenas that they came from. Consecutive objects from
+// the same arena are released under a single lock acquisition
+void tcache_release(tcache_entry_t *list) {
+  arena_t *locked = NULL;
+  while (list != NULL) {
+    void *p = list;
+    list = entry_next(list);
+    arena_t *a = object_arena(p);
+    if (a != locked) {
+      if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+      }
+      pthread_mutex_lock(&a->lock);
+      locked = a;
+    }
+    release_cached(a, p);
+  }
+  if (locked != NULL) {
+    pthread_mutex_unlock(&locked->lock);
+  }
+}
+
+// Free a small object that came from another arena by pushing it onto that arena's queue of remote
+// frees, which takes a single compare and swap and never waits on the arena's lock. Objects on the
+// queue are marked like cached ones, with the queue as their key. Once the queue is long enough, it
+// is drained here if the arena's lock happens to be free
+void remote_free(arena_t *a, void *p) {
+  tcache_entry_t *entry = p;
+  set_entry_key(entry, &a->remote_frees);
+  if (!in_slab_region(p)) {
+    ((header_t *) ((char *) p - sizeof(header_t)))->flags |= HDR_CACHED;
+  }
+  tcache_entry_t *head = atomic_load_explicit(&a->remote_frees, memory_order_relaxed);
+  do {
+    set_entry_next(entry, head);
+  } while (!atomic_compare_exchange_weak_explicit(&a->remote_frees, &head, entry,
+      memory_order_release, memory_order_relaxed));
+  size_t queued = atomic_fetch_add_explicit(&a->remote_count, 1, memory_order_relaxed) + 1;
+  if (queued >= REMOTE_DRAIN_MAX && pthread_mutex_trylock(&a->lock) == 0) {
+    drain_remote_frees(a);
+    pthread_mutex_unlock(&a->lock);
+  }
+}
+
+// Mark every entry of a list of cached objects with the given key, and return how many there are
+size_t mark_entries(tcache_entry_t *list, const void *key) {
+  size_t n = 0;
+  for (tcache_entry_t *entry = list; entry != NULL; entry = entry_next(entry)) {
+    set_entry_key(entry, key);
+    n++;
+  }
+  return n;
+}
+
+// Put a batch of objects drained from bin i of a thread's cache into one of the transfer slots of
+// the arena that they all belong to. Objects in a slot are marked like cached ones, with the slots
+// of their size class as their key. Returns false if every slot is full
+bool transfer_put(arena_t *a, size_t i, tcache_entry_t *list) {
+  _Atomic(tcache_entry_t *) *slots = a->transfer[i];
+  size_t s = 0;
+  while (s < TRANSFER_SLOTS && atomic_load_explicit(&slots[s], memory_order_relaxed) != NULL) {
+    s++;
+  }
+  if (s == TRANSFER_SLOTS) {
+    return false;
+  }
+  mark_entries(list, slots);
+  for (; s < TRANSFER_SLOTS; s++) {
+    tcache_entry_t *empty = NULL;
+    if (atomic_compare_exchange_strong_explicit(&slots[s], &empty, list, memory_order_release,
+        memory_order_relaxed)) {
+      return true;
+    }
+  }
+  mark_entries(list, NULL);
+  return false;
+}
+
+// Take a batch of objects of bin i out of one of the arena's transfer slots, or return NULL if they
+// are all empty. The entries keep their transfer key until they are marked again
+tcache_entry_t *transfer_take(arena_t *a, size_t i) {
+  _Atomic(tcache_entry_t *) *slots = a->transfer[i];
+  for (size_t s = 0; s < TRANSFER_SLOTS; s++) {
+    if (atomic_load_explicit(&slots[s], memory_order_relaxed) != NULL) {
+      tcache_entry_t *list = atomic_exchange_explicit(&slots[s], NULL, memory_order_acquire);
+      if (list != NULL) {
+        return list;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Give everything in the arena's transfer slots back to it. The arena's lock must be held
+void transfer_flush(arena_t *a) {
+  for (size_t i = 0; i < NUM_SMALL_BINS; i++) {
+    tcache_entry_t *list;
+    while ((list = transfer_take(a, i)) != NULL) {
+      while (list != NULL) {
+        tcache_entry_t *entry = list;
+        list = entry_next(list);
+        set_entry_key(entry, NULL);
+        release_cached(a, entry);
+      }
+    }
+  }
+}
+
+// Give back everything that other threads have freed into an arena. The queue is taken all at once,
+// so pushes never race with anything but each other. The arena's lock must be held
+void drain_remote_frees(arena_t *a) {
+  if (atomic_load_explicit(&a->remote_frees, memory_order_relaxed) == NULL) {
+    return;
+  }
+  // The count is reset first, so a push that lands in between is counted once more than it should
+  // be, which only makes the next drain come a little early
+  atomic_store_explicit(&a->remote_count, 0, memory_order_relaxed);
+  tcache_entry_t *list = atomic_exchange_explicit(&a->remote_frees, NULL, memory_order_acquire);
+  while (list != NULL) {
+    tcache_entry_t *entry = list;
+    list = entry_next(list);
+    set_entry_key(entry, NULL);
+    release_cached(a, entry);
+  }
+}
+
+// Lock an arena to allocate from it, and give back everything that other threads have freed into
+// it since
+void lock_arena(arena_t *a) {
+  pthread_mutex_lock(&a->lock);
+  drain_remote_frees(a);
+}
+
+// Purge every arena once an epoch for as long as the background thread stays turned on
+void *background_main(void *arg) {
+  (void) arg;
+  for (;;) {
+    pthread_mutex_lock(&background_lock);
+    if (!atomic_load_explicit(&background_thread, memory_order_relaxed)) {
+      background_running = false;
+      pthread_mutex_unlock(&background_lock);
+      return NULL;
+    }
+    pthread_mutex_unlock(&background_lock);
+    size_t decay = atomic_load_explicit(&decay_time, memory_order_relaxed);
+    size_t ms = decay / DECAY_STEPS;
+    ms = decay == 0 ? 1000 : ms == 0 ? 1 : ms;
+    struct timespec ts = {(time_t) (ms / 1000), (long) (ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+    for (size_t i = 0; i < num_arenas; i++) {
+      lock_arena(&arenas[i]);
+      decay_arena(&arenas[i]);
+      pthread_mutex_unlock(&arenas[i].lock);
+    }
+  }
+}
+
+// Start the background thread if it is turned on and isn't running yet. It blocks every signal so
+// that they go to the program's own threads. Creating a thread can allocate, so no arena lock can
+// be held
+void start_background_thread(void) {
+  pthread_mutex_lock(&background_lock);
+  if (atomic_load_explicit(&background_thread, memory_order_relaxed) && !background_running) {
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    background_running = pthread_create(&thread, &attr, background_main, NULL) == 0;
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+  }
+  pthread_mutex_unlock(&background_lock);
+}
+
+// Give all of the exiting thread's cached objects back to their arenas
+void tcache_destroy(void *arg) {
+  (void) arg;
+  for (size_t i = 0; i < NUM_SMALL_BINS; i++) {
+    tcache_release(tcache.bins[i]);
+    tcache.bins[i] = NULL;
+    tcache.counts[i] = 0;
+  }
+  pthread_mutex_lock(&tcache_lock);
+  if (tcache.prev != NULL) {
+    tcache.prev->next = tcache.next;
+  } else {
+    tcache_threads = tcache.next;
+  }
+  if (tcache.next != NULL) {
+    tcache.next->prev = tcache.prev;
+  }
+  pthread_mutex_unlock(&tcache_lock);
+  tcache.registered = false;
+}
+
+void tcache_create_key(void) {
+  pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+// Register the calling thread's cache so that it gets drained when the thread exits. Setting the
+// key's value can allocate, so the cache is marked as registered first to keep it from recursing
+void tcache_init(void) {
+  tcache.registered = true;
+  pthread_mutex_lock(&tcache_lock);
+  tcache.prev = NULL;
+  tcache.next = tcache_threads;
+  if (tcache_threads != NULL) {
+    tcache_threads->prev = &tcache;
+  }
+  tcache_threads = &tcache;
+  pthread_mutex_unlock(&tcache_lock);
+  pthread_once(&tcache_key_once, tcache_create_key);
+  pthread_setspecific(tcache_key, &tcache);
+}
+
+// Give back everything cached by the threads other than the calling one and take their caches off
+// the list, in the child of a fork where those threads don't exist anymore. A thread could have
+// been stopped in the middle of changing a bin, so a bin is only followed for as long as its
+// entries are still marked as belonging to the cache
+void reclaim_thread_caches(void) {
+  for (tcache_t *t = tcache_threads; t != NULL; t = t->next) {
+    if (t == &tcache) {
+      continue;
+    }
+    for (size_t i = 0; i < NUM_SMALL_BINS; i++) {
+      tcache_entry_t *entry = t->bins[i];
+      while (entry != NULL && entry_has_key(entry, t)) {
+        tcache_entry_t *next = entry_next(entry);
+        set_entry_key(entry, NULL);
+        arena_t *a = object_arena(entry);
+        pthread_mutex_lock(&a->lock);
+        release_cached(a, entry);
+        pthread_mutex_unlock(&a->lock);
+        entry = next;
+      }
+      t->bins[i] = NULL;
+      t->counts[i] = 0;
+    }
+    t->registered = false;
+  }
+  tcache_threads = tcache.registered ? &tcache : NULL;
+  tcache.prev = NULL;
+  tcache.next = NULL;
+}
+
+// Put an object into the given bin of the calling thread's cache
+void tcache_push(size_t i, void *p) {
+  tcache_entry_t *entry = p;
+  set_entry_next(entry, tcache.bins[i]);
+  set_entry_key(entry, &tcache);
+  if (!in_slab_region(p)) {
+    ((header_t *) ((char *) p - sizeof(header_t)))->flags |= HDR_CACHED;
+  }
+  // The entry is only put in the bin once it is linked, so that a fork can't catch the bin pointing
+  // at an entry that isn't
+  atomic_signal_fence(memory_order_release);
+  tcache.bins[i] = entry;
+  tcache.counts[i]++;
+}
+
+// Return true if the given object is in the given bin of the calling thread's cache
+bool tcache_contains(size_t i, void *p) {
+  for (tcache_entry_t *entry = tcache.bins[i]; entry != NULL; entry = entry_next(entry)) {
+    if (entry == p) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Return true if the given slab object of bin i has already been freed and is waiting in the
+// calling thread's cache, on its arena's queue of remote frees or in its arena's transfer slots
+bool already_freed(size_t i, void *p) {
+  if (entry_has_key(p, &tcache)) {
+    return tcache_contains(i, p);
+  }
+  arena_t *a = object_arena(p);
+  return entry_has_key(p, &a->remote_frees) || entry_has_key(p, a->transfer[i]);
+}
+
+// Allocate an object of dsize bytes from the given arena for the thread cache, from a slab if the
+// size is small enough and from the heap otherwise. The arena's lock must be held. Returns NULL on
+// failure
+void *arena_alloc_small(arena_t *a, size_t dsize) {
+  if (dsize <= atomic_load_explicit(&slab_max_size, memory_order_relaxed)) {
+    void *p = slab_alloc(a, bin_index(dsize));
+    if (p != NULL) {
+      return p;
+    }
+  }
+  header_t *block = heap_alloc(a, dsize, NULL);
+  return block != NULL ? (void *) (block + 1) : NULL;
+}
+
+// Take the most recently cached object out of the given bin of the calling thread's cache. Returns
+// NULL if the bin is empty
+void *tcache_pop(size_t i) {
+  tcache_entry_t *entry = tcache.bins[i];
+  if (entry == NULL) {
+    return NULL;
+  }
+  tcache.bins[i] = entry_next(entry);
+  tcache.counts[i]--;
+  set_entry_key(entry, NULL);
+  if (!in_slab_region(entry)) {
+    ((header_t *) ((char *) entry - sizeof(header_t)))->flags &= ~HDR_CACHED;
+  }
+  return entry;
+}
+
+// Allocate a small object of dsize bytes through the calling thread's cache. If the cache bin is
+// empty, it is refilled with a batch from the transfer slots of the thread's arena, or failing that
+// with a batch of objects allocated from the arena. Returns NULL on failure
+void *tcache_alloc(size_t dsize) {
+  size_t i = bin_index(dsize);
+  void *cached = tcache_pop(i);
+  if (cached != NULL) {
+    return cached;
+  }
+  if (!tcache.registered) {
+    tcache_init();
+  }
+  arena_t *a = get_arena();
+  tcache_entry_t *moved = transfer_take(a, i);
+  if (moved != NULL) {
+    // The bin is empty, so the batch becomes all of it. Its entries are marked before it goes in,
+    // so that a fork can't catch the bin holding entries that don't belong to it yet
+    uint32_t n = (uint32_t) mark_entries(moved, &tcache);
+    atomic_signal_fence(memory_order_release);
+    tcache.bins[i] = moved;
+    tcache.counts[i] = n;
+    return tcache_pop(i);
+  }
+  lock_arena(a);
+  void *p = arena_alloc_small(a, dsize);
+  size_t half = atomic_load_explicit(&tcache_max, memory_order_relaxed) / 2;
+  size_t batch = half < TCACHE_BATCH ? half : TCACHE_BATCH;
+  for (size_t n = 1; p != NULL && n < batch; n++) {
+    void *extra = arena_alloc_small(a, dsize);
+    if (extra == NULL) {
+      break;
+    }
+    tcache_push(i, extra);
+  }
+  pthread_mutex_unlock(&a->lock);
+  return p;
+}
+
+// Free a small object into the given bin of the calling thread's cache. If that fills the cache bin
+// past its limit, the older half of its objects goes into a transfer slot of the thread's arena for
+// other threads' caches to take, or is given back to the arena if the slots are full. Objects from
+// other arenas go onto their arena's queue of remote frees instead, so that they aren't handed out
+// again by the wrong arena's threads and a thread that only frees never has to take the lock of the
+// arena that allocated them
+void tcache_free(size_t i, void *p) {
+  arena_t *owner = object_arena(p);
+  if (owner != get_arena()) {
+    remote_free(owner, p);
+    return;
+  }
+  if (!tcache.registered) {
+    tcache_init();
+  }
+  tcache_push(i, p);
+  size_t max = atomic_load_explicit(&tcache_max, memory_order_relaxed);
+  if (tcache.counts[i] > max) {
+    // Split the oldest objects off the end of the bin and release them, keeping the newest half
+    size_t keep = max / 2;
+    tcache_entry_t *last = NULL;
+    tcache_entry_t *rest = tcache.bins[i];
+    for (size_t n = 0; n < keep; n++) {
+      last = rest;
+      rest = entry_next(rest);
+    }
+    if (last != NULL) {
+      set_entry_next(last, NULL);
+    } else {
+      tcache.bins[i] = NULL;
+    }
+    // Everything in the cache came from the thread's own arena, which is owner. With caching
+    // turned off nothing waits in the transfer slots either
+    if (max == 0 || !transfer_put(owner, i, rest)) {
+      tcache_release(rest);
+    }
+    tcache.counts[i] = (uint32_t) keep;
+  }
+}
+
+// Get the hash that the profiler files the given pointer under
+size_t prof_hash(void *p) {
+  return (size_t) (((uintptr_t) p * UINT64_C(0x9E3779B97F4A7C15)) >> 32);
+}
+
+// Draw the number of bytes until the calling thread's next sample from an exponential distribution
+// with a mean of rate bytes. The logarithm is approximated to within a fraction of a percent, which
+// is plenty for spreading samples out
+intptr_t prof_next_interval(size_t rate) {
+  if (prof_rng == 0) {
+    prof_rng = (uintptr_t) &prof_rng ^ UINT64_C(0x2545F4914F6CDD1D);
+  }
+  prof_rng ^= prof_rng >> 12;
+  prof_rng ^= prof_rng << 25;
+  prof_rng ^= prof_rng >> 27;
+  // A uniform number in (0, 1] is r / 2^53, and -ln of it is (53 - log2(r)) * ln(2)
+  uint64_t r = ((prof_rng * UINT64_C(0x2545F4914F6CDD1D)) >> 11) + 1;
+  int e = 63 - __builtin_clzll(r);
+  double m = (double) r / (double) ((uint64_t) 1 << e) - 1;
+  double log2_r = e + m * (1.3465 - 0.3465 * m);
+  double interval = (53 - log2_r) * 0.6931471805599453 * (double) rate;
+  if (interval < 1) {
+    return 1;
+  }
+  return interval < (double) (INTPTR_MAX / 2) ? (intptr_t) interval : INTPTR_MAX / 2;
+}
+
+// Get an unused sample record, mapping more of them if there aren't any. The profile lock must be
+// held. Returns NULL if the mapping failed
+prof_sample_t *prof_new_sample(void) {
+  if (prof_free_samples == NULL) {
+    prof_sample_t *chunk = mmap(NULL, PROF_POOL_CHUNK, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    stat_add(STAT_MMAP_CALLS, 1);
+    if (chunk == MAP_FAILED) {
+      return NULL;
+    }
+    for (size_t i = 0; i < PROF_POOL_CHUNK / sizeof(prof_sample_t); i++) {
+      chunk[i].next = prof_free_samples;
+      prof_free_samples = &chunk[i];
+    }
+  }
+  prof_sample_t *sample = prof_free_samples;
+  prof_free_samples = sample->next;
+  return sample;
+}
+
+int prof_dump_locked(const char *path);
+
+// Take a sample of the size byte allocation at p if profiling is on, and start the countdown to the
+// calling thread's next one. A thread's first countdown is started without taking a sample, so
+// that every thread's first allocation isn't always sampled
+void prof_sample(void *p, size_t size) {
+  size_t rate = atomic_load_explicit(&prof_rate, memory_order_relaxed);
+  if (rate == 0) {
+    prof_countdown = PROF_RECHECK;
+    return;
+  }
+  bool first = prof_rng == 0;
+  prof_countdown = prof_next_interval(rate);
+  if (first || p == NULL || prof_busy) {
+    return;
+  }
+  // Getting the backtrace can allocate the first time, which must not be sampled
+  prof_busy = true;
+  void *stack[PROF_MAX_DEPTH];
+  int depth = backtrace(stack, PROF_MAX_DEPTH);
+  pthread_mutex_lock(&prof_lock);
+  prof_sample_t *sample = prof_new_sample();
+  if (sample != NULL) {
+    // The first frame is this function
+    sample->ptr = p;
+    sample->size = size;
+    sample->depth = depth > 1 ? depth - 1 : 0;
+    memcpy(sample->stack, stack + 1, (size_t) sample->depth * sizeof(void *));
+    size_t h = prof_hash(p);
+    sample->next = prof_buckets[h % PROF_BUCKETS];
+    prof_buckets[h % PROF_BUCKETS] = sample;
+    // A filter slot that fills up stays full, which only costs some lookups
+    unsigned char count = atomic_load_explicit(&prof_filter[h % PROF_FILTER_SIZE],
+        memory_order_relaxed);
+    if (count != UCHAR_MAX) {
+      atomic_store_explicit(&prof_filter[h % PROF_FILTER_SIZE], count + 1, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&prof_live, 1, memory_order_relaxed);
+  }
+  if (atomic_exchange_explicit(&prof_dump_pending, false, memory_order_relaxed)) {
+    prof_dump_locked(prof_signal_path);
+  }
+  pthread_mutex_unlock(&prof_lock);
+  prof_busy = false;
+}
+
+// Count an allocation of size bytes at p towards the calling thread's next heap profile sample
+void sample_alloc(void *p, size_t size) {
+  prof_countdown -= (intptr_t) size;
+  if (prof_countdown < 0) {
+    prof_sample(p, size);
+  }
+}
+
+// Stop tracking the allocation at p if it was sampled. The filter is looked at first, so that most
+// frees don't have to take the profile lock
+void prof_forget(void *p) {
+  size_t h = prof_hash(p);
+  if (atomic_load_explicit(&prof_filter[h % PROF_FILTER_SIZE], memory_order_relaxed) == 0) {
+    return;
+  }
+  pthread_mutex_lock(&prof_lock);
+  for (prof_sample_t **link = &prof_buckets[h % PROF_BUCKETS]; *link != NULL;
+      link = &(*link)->next) {
+    prof_sample_t *sample = *link;
+    if (sample->ptr == p) {
+      *link = sample->next;
+      sample->next = prof_free_samples;
+      prof_free_samples = sample;
+      unsigned char count = atomic_load_explicit(&prof_filter[h % PROF_FILTER_SIZE],
+          memory_order_relaxed);
+      if (count != UCHAR_MAX) {
+        atomic_store_explicit(&prof_filter[h % PROF_FILTER_SIZE], count - 1,
+            memory_order_relaxed);
+      }
+      atomic_fetch_sub_explicit(&prof_live, 1, memory_order_relaxed);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&prof_lock);
+}
+
+// Account for the allocation at old being resized in place or moved to new with size bytes, the
+// same way as if it had been freed and allocated again, so that a sample never keeps a stale
+// address or size
+void prof_resize(void *old, void *new, size_t size) {
+  if (atomic_load_explicit(&prof_live, memory_order_relaxed) != 0) {
+    prof_forget(old);
+  }
+  sample_alloc(new, size);
+}
+
+// Buffered output for writing a profile, which has to work inside of a signal handler and so can
+// only use write
+typedef struct prof_writer {
+  int fd;
+  size_t len;
+  char buf[4096];
+} prof_writer_t;
+
+// Write out whatever is buffered
+void prof_flush(prof_writer_t *w) {
+  size_t done = 0;
+  while (done < w->len) {
+    ssize_t n = write(w->fd, w->buf + done, w->len - done);
+    if (n <= 0 && errno != EINTR) {
+      break;
+    }
+    done += n > 0 ? (size_t) n : 0;
+  }
+  w->len = 0;
+}
+
+// Add n bytes to the output
+void prof_put(prof_writer_t *w, const char *s, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (w->len == sizeof(w->buf)) {
+      prof_flush(w);
+    }
+    w->buf[w->len++] = s[i];
+  }
+}
 
-// Pointers which keep track of the program's heap space
-char *heap_start = NULL;
-char *heap_end = NULL;
+// Add a number to the output in base 10 or 16
+void prof_put_num(prof_writer_t *w, uintptr_t num, unsigned base) {
+  char digits[24];
+  size_t i = sizeof(digits);
+  do {
+    digits[--i] = "0123456789abcdef"[num % base];
+    num /= base;
+  } while (num != 0);
+  if (base == 16) {
+    prof_put(w, "0x", 2);
+  }
+  prof_put(w, digits + i, sizeof(digits) - i);
+}
 
-// Header which sits right before a block of user memory
-typedef struct header {
-  size_t dsize;
-  uint32_t magic;
-  struct header *next;
-} header_t;
+// Write the live samples to the file at the given path as a heap profile in the legacy format that
+// pprof reads, followed by the process's mappings so that the addresses can be symbolized. The
+// profile lock must be held. Returns 0 on success and -1 on failure
+int prof_dump_locked(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return -1;
+  }
+  prof_writer_t w;
+  w.fd = fd;
+  w.len = 0;
+  size_t count = 0;
+  size_t bytes = 0;
+  for (size_t i = 0; i < PROF_BUCKETS; i++) {
+    for (prof_sample_t *sample = prof_buckets[i]; sample != NULL; sample = sample->next) {
+      count++;
+      bytes += sample->size;
+    }
+  }
+  // Every sample is its own record. pprof scales them back up using the sampling rate
+  prof_put(&w, "heap profile: ", 14);
+  prof_put_num(&w, count, 10);
+  prof_put(&w, ": ", 2);
+  prof_put_num(&w, bytes, 10);
+  prof_put(&w, " [", 2);
+  prof_put_num(&w, count, 10);
+  prof_put(&w, ": ", 2);
+  prof_put_num(&w, bytes, 10);
+  prof_put(&w, "] @ heap_v2/", 12);
+  prof_put_num(&w, atomic_load_explicit(&prof_rate, memory_order_relaxed), 10);
+  prof_put(&w, "\n", 1);
+  for (size_t i = 0; i < PROF_BUCKETS; i++) {
+    for (prof_sample_t *sample = prof_buckets[i]; sample != NULL; sample = sample->next) {
+      prof_put(&w, "1: ", 3);
+      prof_put_num(&w, sample->size, 10);
+      prof_put(&w, " [1: ", 5);
+      prof_put_num(&w, sample->size, 10);
+      prof_put(&w, "] @", 3);
+      for (int j = 0; j < sample->depth; j++) {
+        prof_put(&w, " ", 1);
+        prof_put_num(&w, (uintptr_t) sample->stack[j], 16);
+      }
+      prof_put(&w, "\n", 1);
+    }
+  }
+  prof_put(&w, "\nMAPPED_LIBRARIES:\n", 19);
+  int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (maps != -1) {
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(maps, buf, sizeof(buf))) > 0) {
+      prof_put(&w, buf, (size_t) n);
+    }
+    close(maps);
+  }
+  prof_flush(&w);
+  return close(fd);
+}
 
-// Insert a new block into the heap between the two given header pointers given the address of the
-// new block and the size of its data region
-void insert_block(char *addr, size_t dsize, header_t *prev, header_t *next) {
-  assert(addr != NULL);
-  assert(heap_start != NULL);
+// Write a heap profile of the live sampled allocations to the file at the given path. Returns 0 on
+// success and -1 on failure
+int custom_malloc_prof_dump(const char *path) {
+  pthread_mutex_lock(&prof_lock);
+  int res = prof_dump_locked(path);
+  pthread_mutex_unlock(&prof_lock);
+  return res;
+}
 
-  header_t *block = (header_t *) addr;
-  block->dsize = dsize;
-  block->magic = MAGIC;
-  block->next = next;
-  if (prev != NULL) {
-    prev->next = block;
+// Sample allocations once every sample_bytes bytes on average from now on, or stop sampling if it
+// is 0. Allocations that were already sampled stay in the profile until they are freed
+void custom_malloc_prof_start(size_t sample_bytes) {
+  atomic_store_explicit(&prof_rate, sample_bytes, memory_order_relaxed);
+  // The calling thread switches right away, and the others by their next sample or recheck
+  prof_countdown = 0;
+}
+
+// Dump a profile when the profiling signal arrives. If the profile is locked, which might be by the
+// thread that the signal interrupted, the dump is left to the next sample instead
+void prof_signal(int sig) {
+  (void) sig;
+  int saved = errno;
+  if (pthread_mutex_trylock(&prof_lock) == 0) {
+    prof_dump_locked(prof_signal_path);
+    pthread_mutex_unlock(&prof_lock);
+  } else {
+    atomic_store_explicit(&prof_dump_pending, true, memory_order_relaxed);
   }
+  errno = saved;
 }
 
-// Initialize the start of the heap given the block size of the first item. This takes in the size
-// of the first item so that the dummy element does not use up a sbrk call. This function is only 
-// called once in an app's lifetime
-void init_heap(size_t bsize) {
-  size_t initial_size = sizeof(header_t) + bsize;
-  heap_start = sbrk((int) initial_size);
-  if (heap_start == (void *) -1) {
-    heap_start = NULL;
+// Set up dumping profiles on a signal if the environment asks for it (the sampling rate is one of
+// the settings). CUSTOM_MALLOC_PROF_SIGNAL names a signal that dumps a profile to
+// CUSTOM_MALLOC_PROF_FILE, or to custom_malloc.<pid>.heap in the working directory
+void prof_init_from_env(void) {
+  const char *sig = getenv("CUSTOM_MALLOC_PROF_SIGNAL");
+  if (sig == NULL || atoi(sig) <= 0) {
+    return;
+  }
+  const char *file = getenv("CUSTOM_MALLOC_PROF_FILE");
+  if (file != NULL && strlen(file) < sizeof(prof_signal_path)) {
+    strcpy(prof_signal_path, file);
   } else {
-    // Create the dummy head element at the start of the heap
-    insert_block(heap_start, 0, NULL, NULL);
-    heap_end = heap_start + initial_size;
+    snprintf(prof_signal_path, sizeof(prof_signal_path), "custom_malloc.%ld.heap", (long) getpid());
   }
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = prof_signal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(atoi(sig), &action, NULL);
 }
 
-// Given the start of a new block to go at the end of the heap and the size of the block to be
-// added, extend the heap if necessary. Returns 0 on success and -1 on failure
-int expand_heap(char *block_start, size_t bsize) {
-  assert(block_start != NULL);
-  assert(heap_start != NULL);
+// Return true if the calling thread should record the call that it is making into the allocator.
+// Only the outermost call is recorded, so calls that the allocator makes to itself are left out
+bool trace_due(void) {
+  return atomic_load_explicit(&tracing, memory_order_acquire) && trace_depth == 0;
+}
 
-  char *block_end = block_start + bsize;
-  // If the end of the block is past the end of the heap then we need to expand
-  if (block_end > heap_end) {
-    size_t expansion = (size_t) (block_end - heap_end);
-    void *res = sbrk((int) expansion);
-    if (res == (void *) -1) {
-      return -1;
+// Write the records in a ring out to the trace file, or throw them away if there isn't one. The
+// trace lock must be held
+void trace_flush(trace_ring_t *ring) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  while (tail != head && trace_fd != -1) {
+    // The records from the tail to the end of the ring go first when they wrap around
+    size_t start = tail % TRACE_RECORDS;
+    size_t n = head - tail < TRACE_RECORDS - start ? head - tail : TRACE_RECORDS - start;
+    char *data = (char *) &ring->records[start];
+    size_t left = n * sizeof(struct custom_trace_record);
+    while (left > 0) {
+      ssize_t written = write(trace_fd, data, left);
+      if (written <= 0) {
+        if (written == -1 && errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      data += written;
+      left -= (size_t) written;
     }
-    heap_end += expansion;
+    tail += n;
   }
-  return 0;
+  atomic_store_explicit(&ring->tail, head, memory_order_release);
 }
 
-// Check if the given header pointer is valid by checking its location and magic number. NULL is
-// special here since it will cause any for loops to break, so a NULL header is valid
-bool valid_header(header_t *hptr) {
-  if (hptr == NULL) {
-    return true;
-  }
-  // Is the pointer between the start of the heap and the last possible place a header could go?
-  if ((char *) hptr >= heap_start && (char *) hptr <= heap_end - sizeof(header_t)) {
-    return hptr->magic == MAGIC;
-  }
-  return false;
+// Write out an exiting thread's ring and give it up
+void trace_destroy(void *arg) {
+  trace_ring_t *ring = arg;
+  pthread_mutex_lock(&trace_lock);
+  trace_flush(ring);
+  ring->owned = false;
+  pthread_mutex_unlock(&trace_lock);
+  trace_ring = NULL;
 }
 
-// Find the first area in the heap that is large enough to accomodate the block size requested.
-// Returns the pointer to the start of this block, and sets prev to the address of the previous
-// header and next to the address of the next header, if it exists
-char *find_opening(size_t bsize, header_t **prev, header_t **next) {
-  assert(heap_start != NULL);
+void trace_create_key(void) {
+  pthread_key_create(&trace_key, trace_destroy);
+}
 
-  header_t *curr = (header_t *) heap_start;
-  for (;;) {
-    // Get the size of the current block
-    size_t curr_block_size = sizeof(header_t) + curr->dsize;
-    // If the current block has no next block, we didn't find a large enough opening so we will
-    // just add it to the end of the heap
-    if (curr->next == NULL) {
-      *prev = curr;
-      *next = NULL;
-      return (char *) curr + curr_block_size;
-    }
-    char *curr_block_end = (char *) curr + curr_block_size;
-    size_t open_space = (size_t) ((char *) curr->next - curr_block_end);
-    // If the space is large enough to fit the block, return the address of the start of the header
-    // for the new block
-    if (open_space >= bsize) {
-      *prev = curr;
-      *next = curr->next;
-      return curr_block_end;
-    }
-    curr = curr->next;
-    if (!valid_header(curr)) {
+// Get a ring for the calling thread, reusing one that an exited thread gave up if there is one.
+// Each thread that gets one is numbered, even if its ring is reused. Returns NULL on failure
+trace_ring_t *trace_ring_get(void) {
+  pthread_mutex_lock(&trace_lock);
+  trace_ring_t *ring = trace_rings;
+  while (ring != NULL && ring->owned) {
+    ring = ring->next;
+  }
+  if (ring == NULL) {
+    ring = mmap(NULL, sizeof(trace_ring_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+        -1, 0);
+    if (ring == MAP_FAILED) {
+      pthread_mutex_unlock(&trace_lock);
       return NULL;
     }
+    ring->next = trace_rings;
+    trace_rings = ring;
   }
+  ring->owned = true;
+  ring->thread = trace_next_thread++;
+  pthread_mutex_unlock(&trace_lock);
+  trace_ring = ring;
+  // Setting the key's value can allocate, which isn't traced since this is inside a traced call
+  pthread_once(&trace_key_once, trace_create_key);
+  pthread_setspecific(trace_key, ring);
+  return ring;
 }
 
-// Return true if there is space for the given header to expand its data area to the given size
-// before the start of the next header
-bool can_expand(header_t *block, size_t s) {
-  assert(block != NULL);
-  assert(heap_start != NULL);
+// Start tracing a call, and return the time that it started at
+uint64_t trace_begin(void) {
+  trace_depth++;
+  return monotonic_ns();
+}
 
-  char *new_block_end = (char *) block + sizeof(header_t) + s;
-  if (block->next == NULL) {
-    // If the block is at the end of the heap then expansion might be needed
-    expand_heap((char *) block, s + sizeof(header_t));
-    return true;
-  } else {
-    char *next_block_start = (char *) block->next;
-    return (size_t) (next_block_start - new_block_end) >= 0;
+// Add a record of a call that started at the given time to the calling thread's ring, writing the
+// ring out first if it is full
+void trace_add(uint16_t op, uint64_t start, size_t size, size_t alignment, const void *ptr,
+    const void *result) {
+  trace_ring_t *ring = trace_ring != NULL ? trace_ring : trace_ring_get();
+  if (ring == NULL) {
+    return;
+  }
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == TRACE_RECORDS) {
+    pthread_mutex_lock(&trace_lock);
+    trace_flush(ring);
+    pthread_mutex_unlock(&trace_lock);
   }
+  struct custom_trace_record *r = &ring->records[head % TRACE_RECORDS];
+  r->time = start > trace_start_ns ? start - trace_start_ns : 0;
+  r->size = size;
+  r->ptr = (uintptr_t) ptr;
+  r->result = (uintptr_t) result;
+  r->thread = ring->thread;
+  r->op = op;
+  r->alignment_shift = alignment > 1 ? (uint16_t) __builtin_ctzl(alignment) : 0;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
 }
 
-// Find the block of memory given its header pointer, setting the address of the previous block if
-// found. Returns NULL if the block does not exist, or -1 if the heap is corrupted
-header_t *find_block(header_t *target, header_t **prev) {
-  assert(heap_start != NULL);
-  assert(target != NULL);
+// Finish tracing a call once its records have been added
+void trace_end(void) {
+  trace_depth--;
+}
 
-  header_t *curr = (header_t *) heap_start;
-  while (curr != NULL) {
-    // If the current block is the target pointer, we found the correct block
-    if (curr == target) {
-      return curr;
-    }
-    *prev = curr;
-    curr = curr->next;
-    if (!valid_header(curr)) {
-      return (void *) -1;
-    }
+// Stop tracing, write out every ring and close the trace file. The trace lock must be held
+void trace_stop_locked(void) {
+  atomic_store_explicit(&tracing, false, memory_order_relaxed);
+  for (trace_ring_t *ring = trace_rings; ring != NULL; ring = ring->next) {
+    trace_flush(ring);
+  }
+  if (trace_fd != -1) {
+    close(trace_fd);
+    trace_fd = -1;
+  }
+}
+
+// Record every call into the allocator to the file at the given path from now on, stopping a trace
+// that is already running first. Returns 0 on success and -1 if the file couldn't be opened
+int custom_malloc_trace_start(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return -1;
+  }
+  pthread_mutex_lock(&trace_lock);
+  trace_stop_locked();
+  trace_fd = fd;
+  trace_start_ns = monotonic_ns();
+  atomic_store_explicit(&tracing, true, memory_order_release);
+  pthread_mutex_unlock(&trace_lock);
+  return 0;
+}
+
+// Stop tracing and write out everything that was recorded
+void custom_malloc_trace_stop(void) {
+  pthread_mutex_lock(&trace_lock);
+  trace_stop_locked();
+  pthread_mutex_unlock(&trace_lock);
+}
+
+// Write out what is left of a trace when the program exits, since the rings of threads that are
+// still running would be lost otherwise
+__attribute__((destructor)) void trace_exit(void) {
+  if (atomic_load_explicit(&tracing, memory_order_relaxed)) {
+    custom_malloc_trace_stop();
+  }
+}
+
+// Stop tracing in the child of a fork without writing anything, since whatever is in the rings was
+// recorded by the parent, and give up the rings of the threads that didn't make it through. The
+// trace lock must be held
+void trace_fork_child(void) {
+  atomic_store_explicit(&tracing, false, memory_order_relaxed);
+  if (trace_fd != -1) {
+    close(trace_fd);
+    trace_fd = -1;
+  }
+  for (trace_ring_t *ring = trace_rings; ring != NULL; ring = ring->next) {
+    trace_flush(ring);
+    ring->owned = ring == trace_ring;
   }
-  return NULL;
 }
 
 // Allocate a new block of memory with a size of s bytes. Returns a pointer to the newly allocated
 // space in memory, or NULL if the allocation failed
 void *custom_malloc(size_t s) {
-  // Size of the region needed to store this allocation
-  size_t bsize = sizeof(header_t) + s;
-  // If the heap hasn't been used before, initialize it
-  bool just_initialized = false;
-  if (heap_start == NULL) {
-    init_heap(bsize);
-    just_initialized = true;
-    if (heap_start == NULL) {
-      debug_printf("Malloc 0 bytes (Heap initialization failed)\n");
-      return NULL;
+  if (trace_due()) {
+    uint64_t start = trace_begin();
+    void *p = custom_malloc(s);
+    trace_add(CUSTOM_TRACE_MALLOC, start, s, 0, NULL, p);
+    trace_end();
+    return p;
+  }
+  // Size of the data region needed to store this allocation once it is rounded up to its size class
+  size_t dsize = class_size(s);
+  header_t *block;
+  if (dsize <= SMALL_MAX) {
+    void *p = tcache_alloc(dsize);
+    if (p != NULL) {
+      stat_alloc(usable_size(p));
+      sample_alloc(p, s);
+      debug_printf("Malloc %zu bytes\n", s);
     }
+    return p;
+  } else if (dsize >= atomic_load_explicit(&mmap_threshold, memory_order_relaxed)) {
+    pthread_once(&arenas_once, init_arenas);
+    block = mmap_alloc(dsize, ALIGNMENT);
+  } else {
+    arena_t *a = get_arena();
+    lock_arena(a);
+    block = heap_alloc(a, dsize, NULL);
+    pthread_mutex_unlock(&a->lock);
   }
-  header_t *prev, *next;
-  char *malloc_block_start = find_opening(bsize, &prev, &next);
-  // If something went wrong while looking through the heap
-  if (malloc_block_start == NULL) {
-    debug_printf("Malloc 0 bytes (Heap corrupted)\n");
+  if (block == NULL) {
     return NULL;
   }
-  // If we need to add the block to the end of the heap and it wasn't already added by init_heap, 
-  // try to extend the heap to accomodate the new block
-  if (next == NULL && !just_initialized) {
-    if (expand_heap(malloc_block_start, bsize) == -1) {
-      debug_printf("Malloc 0 bytes (Heap expansion failed)\n");
-      return NULL;
-    }
-  }
-  // Insert this new block into the linked list
-  insert_block(malloc_block_start, s, prev, next);
+  stat_alloc(block->dsize);
+  sample_alloc(block + 1, s);
   debug_printf("Malloc %zu bytes\n", s);
   // Return the start of the block plus the header size to get the user's data
-  return (void *) (malloc_block_start + sizeof(header_t));
+  return (void *) ((char *) block + sizeof(header_t));
+}
+
+// Allocate count allocations of s bytes each and store the pointers to them in out. Small objects
+// come out of the thread cache first, and everything up to the mmap threshold then comes from the
+// thread's arena under a single lock, where consecutive objects are carved out of the same slab or
+// the top of the heap one after another. Returns the number of allocations made, which is less
+// than count if an allocation failed
+size_t custom_malloc_batch(size_t s, size_t count, void **out) {
+  if (trace_due()) {
+    uint64_t start = trace_begin();
+    size_t n = custom_malloc_batch(s, count, out);
+    for (size_t i = 0; i < n; i++) {
+      trace_add(CUSTOM_TRACE_MALLOC, start, s, 0, NULL, out[i]);
+    }
+    trace_end();
+    return n;
+  }
+  size_t dsize = class_size(s);
+  size_t n = 0;
+  if (dsize >= atomic_load_explicit(&mmap_threshold, memory_order_relaxed)) {
+    while (n < count && (out[n] = custom_malloc(s)) != NULL) {
+      n++;
+    }
+    return n;
+  }
+  if (dsize <= SMALL_MAX) {
+    while (n < count && (out[n] = tcache_pop(bin_index(dsize))) != NULL) {
+      n++;
+    }
+  }
+  if (n < count) {
+    arena_t *a = get_arena();
+    lock_arena(a);
+    for (; n < count; n++) {
+      if (dsize <= SMALL_MAX) {
+        out[n] = arena_alloc_small(a, dsize);
+      } else {
+        header_t *block = heap_alloc(a, dsize, NULL);
+        out[n] = block != NULL ? block + 1 : NULL;
+      }
+      if (out[n] == NULL) {
+        break;
+      }
+    }
+    pthread_mutex_unlock(&a->lock);
+  }
+  for (size_t i = 0; i < n; i++) {
+    stat_alloc(usable_size(out[i]));
+    sample_alloc(out[i], s);
+  }
+  debug_printf("Malloc %zu bytes %zu times\n", s, n);
+  return n;
+}
+
+// Allocate s bytes aligned to the given power of two alignment. Returns NULL on failure
+void *aligned_malloc(size_t alignment, size_t s) {
+  if (trace_due()) {
+    uint64_t start = trace_begin();
+    void *p = aligned_malloc(alignment, s);
+    trace_add(CUSTOM_TRACE_ALIGNED_ALLOC, start, s, alignment, NULL, p);
+    trace_end();
+    return p;
+  }
+  if (alignment <= ALIGNMENT) {
+    return custom_malloc(s);
+  }
+  size_t dsize = class_size(s);
+  // Slab objects are aligned to their size up to the size of a slab, so a small enough request
+  // just has to be rounded up to a multiple of the alignment. The object might still have come
+  // from the heap if there are no slabs left, in which case it goes through the normal path
+  size_t slab_max = atomic_load_explicit(&slab_max_size, memory_order_relaxed);
+  if (alignment <= SLAB_SIZE && dsize <= slab_max) {
+    size_t rounded = (dsize + alignment - 1) & ~(alignment - 1);
+    if (rounded <= slab_max) {
+      void *p = tcache_alloc(rounded);
+      if (p == NULL || ((uintptr_t) p & (alignment - 1)) == 0) {
+        if (p != NULL) {
+          stat_alloc(usable_size(p));
+          sample_alloc(p, s);
+        }
+        debug_printf("Malloc %zu bytes aligned to %zu\n", s, alignment);
+        return p;
+      }
+      stat_alloc(usable_size(p));
+      custom_free(p);
+    }
+  }
+  header_t *block;
+  if (dsize >= atomic_load_explicit(&mmap_threshold, memory_order_relaxed)) {
+    pthread_once(&arenas_once, init_arenas);
+    block = mmap_alloc(dsize, alignment);
+  } else {
+    arena_t *a = get_arena();
+    lock_arena(a);
+    block = heap_alloc_aligned(a, dsize, alignment);
+    pthread_mutex_unlock(&a->lock);
+  }
+  if (block == NULL) {
+    return NULL;
+  }
+  stat_alloc(block->dsize);
+  sample_alloc(block + 1, s);
+  debug_printf("Malloc %zu bytes aligned to %zu\n", s, alignment);
+  return (void *) (block + 1);
+}
+
+// Return true if the given alignment is a power of two
+bool valid_alignment(size_t alignment) {
+  return alignment != 0 && (alignment & (alignment - 1)) == 0;
+}
+
+// Allocate s bytes with the given power of two alignment. Returns a pointer to the newly allocated
+// space in memory, or NULL with errno set to EINVAL if the alignment isn't a power of two or NULL
+// if the allocation failed
+void *custom_aligned_alloc(size_t alignment, size_t s) {
+  if (!valid_alignment(alignment)) {
+    debug_printf("Malloc 0 bytes (Invalid alignment)\n");
+    errno = EINVAL;
+    return NULL;
+  }
+  return aligned_malloc(alignment, s);
+}
+
+// Allocate s bytes with the given power of two alignment, which also has to be a multiple of the
+// size of a pointer, and store the pointer to them in memptr. Returns 0 on success, EINVAL if the
+// alignment isn't valid, or ENOMEM if the allocation failed (memptr is left alone in both cases)
+int custom_posix_memalign(void **memptr, size_t alignment, size_t s) {
+  if (!valid_alignment(alignment) || alignment % sizeof(void *) != 0) {
+    debug_printf("Malloc 0 bytes (Invalid alignment)\n");
+    return EINVAL;
+  }
+  void *p = aligned_malloc(alignment, s);
+  if (p == NULL) {
+    return ENOMEM;
+  }
+  *memptr = p;
+  return 0;
+}
+
+// Allocate s bytes with the given power of two alignment. This is the obsolete version of
+// custom_aligned_alloc and behaves the same way
+void *custom_memalign(size_t alignment, size_t s) {
+  return custom_aligned_alloc(alignment, s);
+}
+
+// Move the data of the allocation at p which has room for old_dsize bytes into a new allocation of
+// s bytes, then free the old one. Returns the new pointer, or NULL if the allocation failed in
+// which case the old allocation is left alone
+void *move_block(void *p, size_t old_dsize, size_t s) {
+  void *new = custom_malloc(s);
+  if (new == NULL) {
+    debug_printf("Realloc 0 to 0 bytes (Allocation failed)\n");
+    return NULL;
+  }
+  memcpy(new, p, old_dsize < s ? old_dsize : s);
+  custom_free(p);
+  debug_printf("Realloc %zu to %zu bytes\n", old_dsize, s);
+  return new;
 }
 
 // Reallocate the block of memory at the given pointer to a new size. Returns a pointer to the
 // newly allocated space in memory which might not necessarily be the same as the old pointer, or
 // NULL if the allocation failed (in which case the old pointer is still valid)
 void *custom_realloc(void *p, size_t s) {
+  if (trace_due()) {
+    uint64_t start = trace_begin();
+    void *new = custom_realloc(p, s);
+    trace_add(CUSTOM_TRACE_REALLOC, start, s, 0, p, new);
+    trace_end();
+    return new;
+  }
   // If the pointer is NULL, just malloc the new size
   if (p == NULL) {
     return custom_malloc(s);
@@ -212,80 +3344,559 @@ void *custom_realloc(void *p, size_t s) {
     custom_free(p);
     return NULL;
   }
-  // Get the header of the old block
-  header_t *prev;
-  header_t *target = (header_t *) ((char *) p - sizeof(header_t));
-  header_t *old = find_block(target, &prev);
-  // If the old block was not found, return NULL
-  if (old == NULL) {
-    debug_printf("Realloc 0 to 0 bytes (Invalid pointer)\n");
+  // A slab object can only stay where it is if the new size is in the same size class
+  if (in_slab_region(p)) {
+    slab_t *slab = valid_slab_object(p);
+    if (slab == NULL) {
+      heap_error("Realloc 0 to 0 bytes (Invalid pointer)");
+      return NULL;
+    }
+    if (class_size(s) == slab->size) {
+      prof_resize(p, p, s);
+      debug_printf("Realloc %u to %zu bytes\n", slab->size, s);
+      return p;
+    }
+    return move_block(p, slab->size, s);
+  }
+  // Get the header of the old block, and return NULL if it isn't a valid allocated block
+  header_t *old = (header_t *) ((char *) p - sizeof(header_t));
+  if (num_arenas != 0 && header_intact(old) && (old->flags & HDR_MMAPPED) && valid_mapping(old)) {
+    // A mapped block is remapped to the new size as long as the new size still belongs in its own
+    // mapping, which avoids copying its pages
+    if (class_size(s) >= atomic_load_explicit(&mmap_threshold, memory_order_relaxed) &&
+        class_size(s) != SIZE_MAX) {
+      size_t old_dsize = old->dsize;
+      header_t *block = mmap_resize(old, class_size(s));
+      if (block != NULL) {
+        stat_free(old_dsize);
+        stat_alloc(block->dsize);
+        prof_resize(p, block + 1, s);
+        debug_printf("Realloc %zu to %zu bytes\n", old_dsize, s);
+        return (char *) block + sizeof(header_t);
+      }
+      if (class_size(s) <= old_dsize) {
+        prof_resize(p, p, s);
+        debug_printf("Realloc %zu to %zu bytes\n", old_dsize, s);
+        return p;
+      }
+    }
+    return move_block(p, old->dsize, s);
+  }
+  arena_t *a = num_arenas != 0 && header_intact(old) ? block_arena(old) : NULL;
+  if (a == NULL) {
+    heap_error("Realloc 0 to 0 bytes (Invalid pointer)");
     return NULL;
-  } else if (old == (void *) -1) {
-    debug_printf("Realloc 0 to 0 bytes (Heap corrupted)\n");
+  }
+  lock_arena(a);
+  if (!valid_header(a, old) || (old->flags & (HDR_FREE | HDR_CACHED))) {
+    pthread_mutex_unlock(&a->lock);
+    heap_error("Realloc 0 to 0 bytes (Invalid pointer)");
     return NULL;
   }
-  if (can_expand(old, s)) {
-    // If the block can be expanded, update the size and return the pointer
-    debug_printf("Realloc %zu to %zu bytes\n", old->dsize, s);
-    old->dsize = s;
-    char *data = (char *) old + sizeof(header_t);
-    return (void *) data;
-  } else {
-    // Otherwise allocate a new block and copy the data over, then free the old pointer
-    void *new = custom_malloc(s);
-    if (new == NULL) {
-      debug_printf("Realloc 0 to 0 bytes (Allocation failed)\n");
-      return NULL;
+  // Resize the block where it is if the space around it allows, otherwise move it
+  size_t old_dsize = old->dsize;
+  if (class_size(s) != SIZE_MAX && heap_resize(a, old, class_size(s))) {
+    size_t new_dsize = old->dsize;
+    pthread_mutex_unlock(&a->lock);
+    stat_free(old_dsize);
+    stat_alloc(new_dsize);
+    prof_resize(p, p, s);
+    debug_printf("Realloc %zu to %zu bytes\n", old_dsize, s);
+    return p;
+  }
+  pthread_mutex_unlock(&a->lock);
+  return move_block(p, old_dsize, s);
+}
+
+// Zero size bytes of memory at p. Big blocks are zeroed with non-temporal stores that go around the
+// cache, since they are less likely to stay in the cache anyway and filling it with zeros would
+// push out everything else
+void zero_memory(void *p, size_t size) {
+#ifdef __SSE2__
+  if (size >= NT_ZERO_MIN ||
+      size >= atomic_load_explicit(&mmap_threshold, memory_order_relaxed) / 2) {
+    __m128i zero = _mm_setzero_si128();
+    char *c = p;
+    char *end = c + (size & ~(size_t) 63);
+    for (; c < end; c += 64) {
+      _mm_stream_si128((__m128i *) c, zero);
+      _mm_stream_si128((__m128i *) (c + 16), zero);
+      _mm_stream_si128((__m128i *) (c + 32), zero);
+      _mm_stream_si128((__m128i *) (c + 48), zero);
     }
-    memcpy(new, p, old->dsize);
-    custom_free(p);
-    debug_printf("Realloc %zu to %zu bytes\n", old->dsize, s);
-    return new;
+    _mm_sfence();
+    memset(end, 0, size & 63);
+    return;
   }
+#endif
+  memset(p, 0, size);
 }
 
 // Allocate and initialize memory for an array of nmemb elements of size s bytes with all values 
 // set to zero. Returns a pointer to the newly allocated space in memory, or NULL if the allocation
-// failed or if the size of an element or the size of the array were equal to zero
+// failed or if the size of an element or the size of the array were equal to zero. If the size of
+// the array overflows, errno is set to ENOMEM. Memory that is known to still be zero, like a new
+// mapping or the untouched top of an arena, isn't zeroed again
 void *custom_calloc(size_t nmemb, size_t s) {
+  if (trace_due()) {
+    uint64_t start = trace_begin();
+    void *p = custom_calloc(nmemb, s);
+    size_t size = s != 0 && nmemb > SIZE_MAX / s ? SIZE_MAX : nmemb * s;
+    trace_add(CUSTOM_TRACE_CALLOC, start, size, 0, NULL, p);
+    trace_end();
+    return p;
+  }
   // If the array's size or the element's size is equal to zero return NULL
   if (nmemb == 0 || s == 0) {
     debug_printf("Calloc 0 bytes (Invalid size)\n");
     return NULL;
   }
-  size_t size = nmemb * s;
-  void *array = custom_malloc(size);
-  if (array == NULL) {
+  size_t size;
+  if (__builtin_mul_overflow(nmemb, s, &size)) {
+    debug_printf("Calloc 0 bytes (Size overflow)\n");
+    errno = ENOMEM;
+    return NULL;
+  }
+  // Small objects are cheap to zero, so they just go through the normal path
+  size_t dsize = class_size(size);
+  if (dsize <= SMALL_MAX) {
+    void *array = custom_malloc(size);
+    if (array == NULL) {
+      debug_printf("Calloc 0 bytes (Allocation failed)\n");
+      return NULL;
+    }
+    memset(array, 0, size);
+    debug_printf("Calloc %zu bytes\n", size);
+    return array;
+  }
+  header_t *block;
+  size_t dirty = 0;
+  if (dsize >= atomic_load_explicit(&mmap_threshold, memory_order_relaxed)) {
+    pthread_once(&arenas_once, init_arenas);
+    block = mmap_alloc(dsize, ALIGNMENT);
+  } else {
+    arena_t *a = get_arena();
+    lock_arena(a);
+    block = heap_alloc(a, dsize, &dirty);
+    pthread_mutex_unlock(&a->lock);
+  }
+  if (block == NULL) {
     debug_printf("Calloc 0 bytes (Allocation failed)\n");
     return NULL;
   }
-  memset(array, 0, size);
+  stat_alloc(block->dsize);
+  sample_alloc(block + 1, size);
+  zero_memory(block + 1, dirty < size ? dirty : size);
   debug_printf("Calloc %zu bytes\n", size);
-  return array;
+  return (void *) (block + 1);
 }
 
-// Free the block of memory at the given pointer. If the pointer is NULL or an invalid region of
-// memory is freed, it will not do anything
-void custom_free(void *p) {
-  // If the pointer is NULL, the list head was freed, or the heap is uninitialized, do nothing
+// Get the number of bytes that can be used in the allocation at the given pointer, which is at
+// least as many as were asked for. Returns 0 if the pointer is NULL or isn't a valid allocation
+size_t custom_malloc_usable_size(void *p) {
+  if (p == NULL || num_arenas == 0) {
+    return 0;
+  }
+  if (in_slab_region(p)) {
+    slab_t *slab = valid_slab_object(p);
+    return slab != NULL ? slab->size : 0;
+  }
+  header_t *block = (header_t *) ((char *) p - sizeof(header_t));
+  if (!header_intact(block) || block_arena(block) == NULL || (block->flags & HDR_FREE)) {
+    return 0;
+  }
+  return block->dsize;
+}
+
+// Get the number of bytes that custom_malloc(size) would give room for, without allocating
+// anything, so that callers can size their buffers to the whole size class. Slab objects and mapped
+// blocks get exactly this many, and heap blocks at least this many since a split can leave a few
+// bytes too small to be a block of their own on the end. Returns 0 if the size can't be allocated
+size_t custom_nallocx(size_t size) {
+  // The mmap threshold can come from the environment, which is read along with the arenas
+  pthread_once(&config_once, init_config);
+  size_t dsize = class_size(size);
+  if (dsize == SIZE_MAX) {
+    return 0;
+  }
+  if (dsize > SMALL_MAX && dsize >= atomic_load_explicit(&mmap_threshold, memory_order_relaxed)) {
+    size_t page = page_size();
+    if (dsize > SIZE_MAX - sizeof(header_t) - page) {
+      return 0;
+    }
+    return ((sizeof(header_t) + dsize + page - 1) & ~(page - 1)) - sizeof(header_t);
+  }
+  return dsize;
+}
+
+// Let go of the arena lock that a run of frees is holding, if there is one
+void unlock_arena(arena_t **locked) {
+  if (*locked != NULL) {
+    pthread_mutex_unlock(&(*locked)->lock);
+    *locked = NULL;
+  }
+}
+
+// Free the allocation at the given pointer as part of a run of frees. A large heap block is given
+// back to its arena under the arena's lock, which is left held in locked so that the next block
+// from the same arena doesn't have to take it again. The lock is let go before anything goes into
+// the thread cache, since filling a cache bin up gives objects back to their arenas
+void free_one(void *p, arena_t **locked) {
+  // If the pointer is NULL or the heap is uninitialized, do nothing
   if (p == NULL) {
     debug_printf("Freed 0 bytes\n");
     return;
   }
-  if (heap_start == NULL || (char *) p - sizeof(header_t) == heap_start) {
-    debug_printf("Freed 0 bytes (Invalid pointer)\n");
+  if (num_arenas == 0) {
+    heap_error("Freed 0 bytes (Invalid pointer)");
     return;
   }
-  header_t *prev;
-  header_t *target = (header_t *) ((char *) p - sizeof(header_t));
-  header_t *block = find_block(target, &prev);
-  // Free the block if it was found and is valid
-  if (block == NULL) {
-    debug_printf("Freed 0 bytes (Invalid pointer)\n");
-  } else if (block == (void *) -1) {
-    debug_printf("Freed 0 bytes (Heap corrupted)\n");
-  } else {
-    prev->next = block->next;
+  if (atomic_load_explicit(&prof_live, memory_order_relaxed) != 0) {
+    prof_forget(p);
+  }
+  // Slab objects don't have a header, so they are checked against their slab instead. Whether the
+  // object is actually allocated is checked once it is given back to its slab
+  if (in_slab_region(p)) {
+    slab_t *slab = valid_slab_object(p);
+    if (slab == NULL) {
+      heap_error("Freed 0 bytes (Invalid pointer)");
+      return;
+    }
+    size_t i = bin_index(slab->size);
+    if (already_freed(i, p)) {
+      heap_error("Freed 0 bytes (Double free)");
+      return;
+    }
+    stat_free(slab->size);
+    debug_printf("Freed %u bytes\n", slab->size);
+    unlock_arena(locked);
+    tcache_free(i, p);
+    return;
+  }
+  // Free the block if its header is intact and it isn't already free or cached. Only the magic
+  // number and arena are checked here so that the thread cache path stays lock free; the full
+  // header check is done when the block is given back to its arena. The block stays in place in the
+  // heap and is put in a bin so that a later allocation of the same size class can reuse it
+  header_t *block = (header_t *) ((char *) p - sizeof(header_t));
+  if (!header_intact(block) || block_arena(block) == NULL) {
+    heap_error("Freed 0 bytes (Invalid pointer)");
+    return;
+  }
+  // Mapped blocks are unmapped right away, and blocks of their size come from the heap from now on
+  if (block->flags & HDR_MMAPPED) {
+    if (!valid_mapping(block)) {
+      heap_error("Freed 0 bytes (Invalid pointer)");
+      return;
+    }
+    stat_free(block->dsize);
     debug_printf("Freed %zu bytes\n", block->dsize);
+    raise_thresholds(block->dsize);
+    mmap_release(block);
+    return;
+  }
+  if (block->flags & (HDR_FREE | HDR_CACHED)) {
+    heap_error("Freed 0 bytes (Double free)");
+    return;
+  }
+  stat_free(block->dsize);
+  debug_printf("Freed %zu bytes\n", block->dsize);
+  if (block->dsize <= SMALL_MAX) {
+    unlock_arena(locked);
+    tcache_free(bin_index(block->dsize), p);
+    return;
+  }
+  arena_t *a = block_arena(block);
+  if (a != *locked) {
+    unlock_arena(locked);
+    pthread_mutex_lock(&a->lock);
+    *locked = a;
+  }
+  heap_release(a, block);
+}
+
+// Free the block of memory at the given pointer. If the pointer is NULL or an invalid region of
+// memory is freed, it will not do anything as long as the memory right before the pointer can be
+// read
+void custom_free(void *p) {
+  if (trace_due()) {
+    uint64_t start = trace_begin();
+    custom_free(p);
+    trace_add(CUSTOM_TRACE_FREE, start, 0, 0, p, NULL);
+    trace_end();
+    return;
+  }
+  arena_t *locked = NULL;
+  free_one(p, &locked);
+  unlock_arena(&locked);
+}
+
+// Free count allocations at once. Small objects go into the thread cache like they do with
+// custom_free, and large heap blocks are given back to their arenas with one lock acquisition for
+// each run of blocks from the same arena
+void custom_free_batch(void **ptrs, size_t count) {
+  if (trace_due()) {
+    uint64_t start = trace_begin();
+    custom_free_batch(ptrs, count);
+    for (size_t i = 0; i < count; i++) {
+      trace_add(CUSTOM_TRACE_FREE, start, 0, 0, ptrs[i], NULL);
+    }
+    trace_end();
+    return;
+  }
+  arena_t *locked = NULL;
+  for (size_t i = 0; i < count; i++) {
+    free_one(ptrs[i], &locked);
+  }
+  unlock_arena(&locked);
+}
+
+// Free the allocation at the given pointer, which was allocated with a size of s bytes. Knowing the
+// size lets a slab object go straight into its cache bin without checking where it sits in its
+// slab. Only hardened and debug builds check the size against the slab, so like C23's free_sized
+// the size has to be the one that was asked for and the pointer can't come from an aligned
+// allocation. Anything that isn't a slab object is freed by custom_free
+void custom_free_sized(void *p, size_t s) {
+  if (trace_due()) {
+    uint64_t start = trace_begin();
+    custom_free_sized(p, s);
+    trace_add(CUSTOM_TRACE_FREE, start, s, 0, p, NULL);
+    trace_end();
+    return;
+  }
+  size_t dsize = class_size(s);
+  if (p == NULL || dsize > atomic_load_explicit(&slab_max_size, memory_order_relaxed) ||
+      !in_slab_region(p)) {
+    custom_free(p);
+    return;
+  }
+#if defined(MEM_DEBUG) || defined(HARDENED)
+  // A wrong size would put the object into the cache of another size class
+  slab_t *slab = valid_slab_object(p);
+  if (slab == NULL || slab->size != dsize) {
+    heap_error("Freed 0 bytes (Wrong size)");
+    custom_free(p);
+    return;
+  }
+#endif
+  size_t i = bin_index(dsize);
+  if (already_freed(i, p)) {
+    heap_error("Freed 0 bytes (Double free)");
+    return;
+  }
+  if (atomic_load_explicit(&prof_live, memory_order_relaxed) != 0) {
+    prof_forget(p);
+  }
+  stat_free(dsize);
+  debug_printf("Freed %zu bytes\n", dsize);
+  tcache_free(i, p);
+}
+
+// Free all of the exiting thread's pooled region chunks
+void region_pool_destroy(void *arg) {
+  (void) arg;
+  while (region_pool.chunks != NULL) {
+    region_chunk_t *chunk = region_pool.chunks;
+    region_pool.chunks = chunk->next;
+    custom_free(chunk);
+  }
+  region_pool.bytes = 0;
+  region_pool.registered = false;
+}
+
+void region_pool_create_key(void) {
+  pthread_key_create(&region_pool_key, region_pool_destroy);
+}
+
+// Get a chunk with room for at least size bytes, from the calling thread's pool if it has one that
+// is big enough. Returns NULL on failure
+region_chunk_t *region_chunk_get(size_t size) {
+  for (region_chunk_t **link = &region_pool.chunks; *link != NULL; link = &(*link)->next) {
+    region_chunk_t *chunk = *link;
+    if (chunk->size >= size) {
+      *link = chunk->next;
+      region_pool.bytes -= chunk->size;
+      return chunk;
+    }
+  }
+  if (size > SIZE_MAX - sizeof(region_chunk_t)) {
+    return NULL;
+  }
+  region_chunk_t *chunk = custom_malloc(sizeof(region_chunk_t) + size);
+  if (chunk == NULL) {
+    return NULL;
+  }
+  chunk->size = custom_malloc_usable_size(chunk) - sizeof(region_chunk_t);
+  return chunk;
+}
+
+// Give a chunk to the calling thread's pool, or free it if the pool is full
+void region_chunk_put(region_chunk_t *chunk) {
+  if (chunk->size > REGION_POOL_MAX - region_pool.bytes) {
+    custom_free(chunk);
+    return;
+  }
+  if (!region_pool.registered) {
+    region_pool.registered = true;
+    pthread_once(&region_pool_key_once, region_pool_create_key);
+    pthread_setspecific(region_pool_key, &region_pool);
+  }
+  chunk->next = region_pool.chunks;
+  region_pool.chunks = chunk;
+  region_pool.bytes += chunk->size;
+}
+
+// Create a region that is expected to hold about hint bytes, which can be 0 if that isn't known.
+// A region isn't thread safe, so only one thread can use it at a time. Returns NULL on failure
+custom_arena_t *custom_arena_create(size_t hint) {
+  custom_arena_t *r = custom_malloc(sizeof(custom_arena_t));
+  if (r == NULL) {
+    return NULL;
+  }
+  r->chunks = NULL;
+  r->ptr = NULL;
+  r->end = NULL;
+  r->first_size = hint > REGION_CHUNK_MIN ? hint : REGION_CHUNK_MIN;
+  r->next_size = r->first_size;
+  return r;
+}
+
+// Allocate s bytes from the given region, aligned the same way as custom_malloc. The memory stays
+// allocated until the region is reset or destroyed. Returns NULL on failure
+void *custom_arena_alloc(custom_arena_t *r, size_t s) {
+  size_t size = class_size(s);
+  if ((size_t) (r->end - r->ptr) < size) {
+    // Whatever is left in the current chunk goes unused
+    region_chunk_t *chunk = region_chunk_get(size > r->next_size ? size : r->next_size);
+    if (chunk == NULL) {
+      return NULL;
+    }
+    chunk->next = r->chunks;
+    r->chunks = chunk;
+    r->ptr = (char *) (chunk + 1);
+    r->end = r->ptr + chunk->size;
+    if (r->next_size < REGION_CHUNK_MAX) {
+      r->next_size *= 2;
+    }
+  }
+  void *p = r->ptr;
+  r->ptr += size;
+  return p;
+}
+
+// Free everything that was allocated from the given region so that it can be used again. Its
+// chunks go to the calling thread's pool to be reused
+void custom_arena_reset(custom_arena_t *r) {
+  while (r->chunks != NULL) {
+    region_chunk_t *chunk = r->chunks;
+    r->chunks = chunk->next;
+    region_chunk_put(chunk);
+  }
+  r->ptr = NULL;
+  r->end = NULL;
+  r->next_size = r->first_size;
+}
+
+// Free everything that was allocated from the given region along with the region itself
+void custom_arena_destroy(custom_arena_t *r) {
+  if (r == NULL) {
+    return;
+  }
+  custom_arena_reset(r);
+  custom_free(r);
+}
+
+// Add up the stats of every thread, including the ones that have exited, into total
+void sum_stats(thread_stats_t *total) {
+  memset(total, 0, sizeof(*total));
+  pthread_mutex_lock(&stats_lock);
+  for (thread_stats_t *st = &retired_stats; st != NULL;
+      st = st == &retired_stats ? stats_threads : st->next) {
+    for (size_t i = 0; i < NUM_STATS; i++) {
+      counter_add(&total->counts[i], atomic_load_explicit(&st->counts[i], memory_order_relaxed));
+    }
+    for (size_t i = 0; i < NUM_BINS; i++) {
+      counter_add(&total->allocs[i], atomic_load_explicit(&st->allocs[i], memory_order_relaxed));
+      counter_add(&total->frees[i], atomic_load_explicit(&st->frees[i], memory_order_relaxed));
+    }
+  }
+  pthread_mutex_unlock(&stats_lock);
+}
+
+// Get a snapshot of the allocator's stats added up over every thread. Threads that are allocating
+// while this runs might have only some of their latest changes counted
+struct custom_mallinfo custom_mallinfo(void) {
+  thread_stats_t total;
+  sum_stats(&total);
+  struct custom_mallinfo info = {0};
+  info.in_use = total.counts[STAT_IN_USE];
+  info.mapped = total.counts[STAT_MAPPED];
+  info.mmapped = total.counts[STAT_DIRECT_MAPPED];
+  for (size_t i = 0; i < NUM_BINS; i++) {
+    info.allocs += total.allocs[i];
+    info.frees += total.frees[i];
+  }
+  if (info.mapped > info.in_use) {
+    info.fragmentation = (double) (info.mapped - info.in_use) / (double) info.mapped;
+  }
+  info.sbrk_calls = total.counts[STAT_SBRK_CALLS];
+  info.mmap_calls = total.counts[STAT_MMAP_CALLS];
+  info.munmap_calls = total.counts[STAT_MUNMAP_CALLS];
+  info.mremap_calls = total.counts[STAT_MREMAP_CALLS];
+  info.madvise_calls = total.counts[STAT_MADVISE_CALLS];
+  info.mbind_calls = total.counts[STAT_MBIND_CALLS];
+  info.searches = total.counts[STAT_SEARCHES];
+  info.search_steps = total.counts[STAT_SEARCH_STEPS];
+  info.nodes = num_nodes;
+  info.local_bytes = total.counts[STAT_LOCAL_BYTES];
+  info.remote_bytes = total.counts[STAT_REMOTE_BYTES];
+  info.dirty = total.counts[STAT_DIRTY_BYTES];
+  info.muzzy = total.counts[STAT_MUZZY_BYTES];
+  return info;
+}
+
+// Fill in the stats of up to n size classes, smallest first. Returns the number of size classes
+// there are, which might be more than n
+size_t custom_malloc_classes(struct custom_malloc_class *classes, size_t n) {
+  thread_stats_t total;
+  sum_stats(&total);
+  for (size_t i = 0; i < n && i < NUM_BINS; i++) {
+    // Large classes hold every size up to the next power of two
+    if (i < NUM_SMALL_BINS) {
+      classes[i].size = (i + 1) * CLASS_STEP;
+    } else if (i - NUM_SMALL_BINS + SMALL_MAX_SHIFT + 1 < sizeof(size_t) * 8) {
+      classes[i].size = ((size_t) 1 << (i - NUM_SMALL_BINS + SMALL_MAX_SHIFT + 1)) - CLASS_STEP;
+    } else {
+      classes[i].size = SIZE_MAX & ~(CLASS_STEP - 1);
+    }
+    classes[i].allocs = total.allocs[i];
+    classes[i].frees = total.frees[i];
+  }
+  return NUM_BINS;
+}
+
+// Print a summary of the allocator's stats to stderr, with a line for every size class that has
+// been used
+void custom_malloc_stats(void) {
+  struct custom_mallinfo info = custom_mallinfo();
+  struct custom_malloc_class classes[NUM_BINS];
+  custom_malloc_classes(classes, NUM_BINS);
+  fprintf(stderr, "In use:          %zu bytes\n", info.in_use);
+  fprintf(stderr, "Mapped:          %zu bytes (%zu in their own mappings)\n", info.mapped,
+      info.mmapped);
+  fprintf(stderr, "Fragmentation:   %.1f%%\n", info.fragmentation * 100);
+  fprintf(stderr, "Allocations:     %zu (%zu freed)\n", info.allocs, info.frees);
+  fprintf(stderr, "System calls:    %zu sbrk, %zu mmap, %zu munmap, %zu mremap, %zu madvise, "
+      "%zu mbind\n", info.sbrk_calls, info.mmap_calls, info.munmap_calls, info.mremap_calls,
+      info.madvise_calls, info.mbind_calls);
+  fprintf(stderr, "Bin searches:    %zu (%.2f blocks looked at on average)\n", info.searches,
+      info.searches != 0 ? (double) info.search_steps / (double) info.searches : 0.0);
+  fprintf(stderr, "NUMA nodes:      %zu (%zu bytes allocated on the arena's node, %zu on others)\n",
+      info.nodes, info.local_bytes, info.remote_bytes);
+  fprintf(stderr, "Waiting purge:   %zu dirty bytes, %zu muzzy bytes\n", info.dirty, info.muzzy);
+  for (size_t i = 0; i < NUM_BINS; i++) {
+    if (classes[i].allocs != 0) {
+      fprintf(stderr, "  Up to %8zu bytes: %zu allocations, %zu in use\n", classes[i].size,
+          classes[i].allocs, classes[i].allocs - classes[i].frees);
+    }
   }
 }
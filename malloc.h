@@ -2,15 +2,138 @@
 #define _MALLOC_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define malloc(size) custom_malloc(size)
 #define realloc(ptr, size) custom_realloc(ptr, size)
 #define calloc(nmemb, size) custom_calloc(nmemb, size)
 #define free(ptr) custom_free(ptr)
+#define aligned_alloc(alignment, size) custom_aligned_alloc(alignment, size)
+#define posix_memalign(memptr, alignment, size) custom_posix_memalign(memptr, alignment, size)
+#define memalign(alignment, size) custom_memalign(alignment, size)
+#define malloc_usable_size(ptr) custom_malloc_usable_size(ptr)
+#define free_sized(ptr, size) custom_free_sized(ptr, size)
+
+// The shared libraries are built with hidden visibility so only the allocator's API is exported
+#define CUSTOM_MALLOC_API __attribute__((visibility("default")))
+
+CUSTOM_MALLOC_API void *custom_malloc(size_t size);
+CUSTOM_MALLOC_API void *custom_realloc(void *ptr, size_t size);
+CUSTOM_MALLOC_API void *custom_calloc(size_t nmemb, size_t size);
+CUSTOM_MALLOC_API void custom_free(void *ptr);
+CUSTOM_MALLOC_API void custom_free_sized(void *ptr, size_t size);
+CUSTOM_MALLOC_API void *custom_aligned_alloc(size_t alignment, size_t size);
+CUSTOM_MALLOC_API int custom_posix_memalign(void **memptr, size_t alignment, size_t size);
+CUSTOM_MALLOC_API void *custom_memalign(size_t alignment, size_t size);
+CUSTOM_MALLOC_API size_t custom_malloc_usable_size(void *ptr);
+CUSTOM_MALLOC_API size_t custom_nallocx(size_t size);
+CUSTOM_MALLOC_API size_t custom_malloc_batch(size_t size, size_t count, void **out);
+CUSTOM_MALLOC_API void custom_free_batch(void **ptrs, size_t count);
+
+// A region that allocations are bumped out of and that is freed all at once
+typedef struct custom_arena custom_arena_t;
+
+CUSTOM_MALLOC_API custom_arena_t *custom_arena_create(size_t hint);
+CUSTOM_MALLOC_API void *custom_arena_alloc(custom_arena_t *arena, size_t size);
+CUSTOM_MALLOC_API void custom_arena_reset(custom_arena_t *arena);
+CUSTOM_MALLOC_API void custom_arena_destroy(custom_arena_t *arena);
+
+// Allocator stats added up over every thread. Sizes count the bytes that allocations have room for,
+// so objects cached for reuse count as free
+struct custom_mallinfo {
+  size_t in_use;         // Bytes in allocations that haven't been freed
+  size_t mapped;         // Bytes taken from the OS, including free space and headers
+  size_t mmapped;        // Part of mapped that belongs to allocations with their own mapping
+  size_t allocs;         // Number of allocations
+  size_t frees;          // Number of frees
+  double fragmentation;  // Share of mapped that isn't in use, from 0 to 1
+  size_t sbrk_calls;
+  size_t mmap_calls;
+  size_t munmap_calls;
+  size_t mremap_calls;
+  size_t madvise_calls;
+  size_t mbind_calls;
+  size_t searches;       // Searches of the free lists
+  size_t search_steps;   // Free blocks looked at during those searches
+  size_t nodes;          // NUMA nodes that arenas are spread over
+  size_t local_bytes;    // Bytes allocated by threads running on the node of their arena
+  size_t remote_bytes;   // Bytes allocated by threads running on another node
+  size_t dirty;          // Free bytes waiting to be advised with MADV_FREE
+  size_t muzzy;          // Free bytes advised with MADV_FREE waiting for MADV_DONTNEED
+};
+
+// Stats of a single size class, which holds allocations of up to size bytes. Resizing an allocation
+// in place counts as freeing it from its old class and allocating it from its new one
+struct custom_malloc_class {
+  size_t size;
+  size_t allocs;
+  size_t frees;
+};
+
+CUSTOM_MALLOC_API struct custom_mallinfo custom_mallinfo(void);
+CUSTOM_MALLOC_API size_t custom_malloc_classes(struct custom_malloc_class *classes, size_t n);
+CUSTOM_MALLOC_API void custom_malloc_stats(void);
+
+// Heap profiling. Once started, allocations are sampled on average once every sample_bytes bytes
+// allocated (0 stops sampling), and a dump writes the sampled allocations that are still live to a
+// file as a heap profile that pprof can read. Profiling can also be turned on with the
+// CUSTOM_MALLOC_PROF environment variable. Dumps return 0 on success and -1 on failure
+CUSTOM_MALLOC_API void custom_malloc_prof_start(size_t sample_bytes);
+CUSTOM_MALLOC_API int custom_malloc_prof_dump(const char *path);
+
+// Allocation tracing. Once started, every call into the allocator is appended to the file at path
+// as a struct custom_trace_record in the machine's byte order, until tracing stops or the program
+// exits. Calls that the allocator makes to itself, like realloc moving a block, aren't recorded.
+// Threads write their records in batches, so the file is only in order for each thread, and
+// bench/replay puts it in order by time. Tracing can also be turned on by setting the
+// CUSTOM_MALLOC_TRACE environment variable to a path. Starting returns 0 on success and -1 if the
+// file couldn't be opened
+enum custom_trace_op {
+  CUSTOM_TRACE_MALLOC,
+  CUSTOM_TRACE_CALLOC,
+  CUSTOM_TRACE_REALLOC,
+  CUSTOM_TRACE_FREE,
+  CUSTOM_TRACE_ALIGNED_ALLOC,
+};
+
+struct custom_trace_record {
+  uint64_t time;             // Nanoseconds from the start of tracing to the start of the call
+  uint64_t size;             // Bytes asked for (nmemb * size for calloc, the size for free_sized)
+  uint64_t ptr;              // Address passed to realloc or free
+  uint64_t result;           // Address returned
+  uint32_t thread;           // Number of the thread, counting from 0 in the order they were traced
+  uint16_t op;               // Which call this was, one of enum custom_trace_op
+  uint16_t alignment_shift;  // Log2 of the alignment asked for by an aligned allocation
+};
+
+CUSTOM_MALLOC_API int custom_malloc_trace_start(const char *path);
+CUSTOM_MALLOC_API void custom_malloc_trace_stop(void);
+
+// Settings for custom_mallopt. The ones that glibc's mallopt also has use the same numbers. Sizes
+// are in bytes, and huge pages are 0 (off) or 1 (on). The number of arenas and huge pages can only
+// be set before the first allocation. Setting either threshold stops both from rising when mapped
+// blocks are freed. The same settings can be given in the CUSTOM_MALLOC_CONF environment variable
+// as a list like "mmap_threshold:1m,trim_threshold:512k,arenas:8,tcache:64,huge_pages:1,prof:512k,
+// decay_time:5000,background_thread:1,slab_max:128"
+#define CUSTOM_M_TRIM_THRESHOLD -1  // Unused bytes at the top of an arena before they're given back
+#define CUSTOM_M_MMAP_THRESHOLD -3  // Size from which allocations get their own mapping
+#define CUSTOM_M_ARENA_MAX -8       // Number of arenas, or 0 for 4 per CPU
+#define CUSTOM_M_TCACHE_COUNT 100   // Objects that a thread caches per size class, or 0 for none
+#define CUSTOM_M_HUGE_PAGES 101     // Whether to back the heap with transparent huge pages
+#define CUSTOM_M_PROF_RATE 102      // Average bytes between profiler samples, or 0 to stop
+#define CUSTOM_M_DECAY_TIME 103     // Milliseconds over which freed memory is given back, or 0
+#define CUSTOM_M_BACKGROUND_THREAD 104  // Whether a thread purges freed memory in the background
+#define CUSTOM_M_SLAB_MAX 105       // Largest object kept in a slab, up to 256, or 0 for no slabs
+
+// Change a setting. Returns 1 on success, or 0 if the setting or value isn't valid
+CUSTOM_MALLOC_API int custom_mallopt(int param, int value);
 
-void *custom_malloc(size_t size);
-void *custom_realloc(void *ptr, size_t size);
-void *custom_calloc(size_t nmemb, size_t size);
-void custom_free(void *ptr);
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* ifndef _MALLOC_H */
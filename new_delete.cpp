@@ -0,0 +1,130 @@
+#include <cstddef>
+#include <new>
+
+#include "malloc.h"
+
+// Replacements for every global operator new and delete that send C++ allocations through the
+// allocator. Sized deletes pass their size on to custom_free_sized so that small objects skip the
+// slab lookup. Aligned allocations can't use the sized path since their size class might have been
+// rounded up for the alignment, so their deletes just free
+
+namespace {
+
+// Allocate size bytes with the given alignment (0 for the default), calling the new handler and
+// trying again until it works or there isn't a handler. Returns nullptr on failure
+void *allocate(std::size_t size, std::size_t alignment) {
+  for (;;) {
+    void *p = alignment == 0 ? custom_malloc(size) : custom_aligned_alloc(alignment, size);
+    if (p != nullptr) {
+      return p;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr) {
+      return nullptr;
+    }
+    handler();
+  }
+}
+
+// Allocate like allocate, but throw std::bad_alloc on failure
+void *allocate_or_throw(std::size_t size, std::size_t alignment) {
+  void *p = allocate(size, alignment);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+// Allocate like allocate, but turn a std::bad_alloc thrown by the new handler into nullptr
+void *allocate_nothrow(std::size_t size, std::size_t alignment) noexcept {
+  try {
+    return allocate(size, alignment);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+}  // namespace
+
+CUSTOM_MALLOC_API void *operator new(std::size_t size) {
+  return allocate_or_throw(size, 0);
+}
+
+CUSTOM_MALLOC_API void *operator new[](std::size_t size) {
+  return allocate_or_throw(size, 0);
+}
+
+CUSTOM_MALLOC_API void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate_nothrow(size, 0);
+}
+
+CUSTOM_MALLOC_API void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate_nothrow(size, 0);
+}
+
+CUSTOM_MALLOC_API void *operator new(std::size_t size, std::align_val_t alignment) {
+  return allocate_or_throw(size, static_cast<std::size_t>(alignment));
+}
+
+CUSTOM_MALLOC_API void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return allocate_or_throw(size, static_cast<std::size_t>(alignment));
+}
+
+CUSTOM_MALLOC_API void *operator new(std::size_t size, std::align_val_t alignment,
+    const std::nothrow_t &) noexcept {
+  return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+CUSTOM_MALLOC_API void *operator new[](std::size_t size, std::align_val_t alignment,
+    const std::nothrow_t &) noexcept {
+  return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+CUSTOM_MALLOC_API void operator delete(void *p) noexcept {
+  custom_free(p);
+}
+
+CUSTOM_MALLOC_API void operator delete[](void *p) noexcept {
+  custom_free(p);
+}
+
+CUSTOM_MALLOC_API void operator delete(void *p, const std::nothrow_t &) noexcept {
+  custom_free(p);
+}
+
+CUSTOM_MALLOC_API void operator delete[](void *p, const std::nothrow_t &) noexcept {
+  custom_free(p);
+}
+
+CUSTOM_MALLOC_API void operator delete(void *p, std::size_t size) noexcept {
+  custom_free_sized(p, size);
+}
+
+CUSTOM_MALLOC_API void operator delete[](void *p, std::size_t size) noexcept {
+  custom_free_sized(p, size);
+}
+
+CUSTOM_MALLOC_API void operator delete(void *p, std::align_val_t) noexcept {
+  custom_free(p);
+}
+
+CUSTOM_MALLOC_API void operator delete[](void *p, std::align_val_t) noexcept {
+  custom_free(p);
+}
+
+CUSTOM_MALLOC_API void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept {
+  custom_free(p);
+}
+
+CUSTOM_MALLOC_API void operator delete[](void *p, std::align_val_t,
+    const std::nothrow_t &) noexcept {
+  custom_free(p);
+}
+
+CUSTOM_MALLOC_API void operator delete(void *p, std::size_t, std::align_val_t) noexcept {
+  custom_free(p);
+}
+
+CUSTOM_MALLOC_API void operator delete[](void *p, std::size_t, std::align_val_t) noexcept {
+  custom_free(p);
+}
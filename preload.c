@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "malloc.h"
+
+// This file turns the allocator into a drop in replacement for the C library's, for use with
+// LD_PRELOAD or by linking it into a program. The standard names are defined here instead of being
+// renamed by malloc.h, so every allocation in the process goes through the allocator, including
+// the ones that libraries like libstdc++ make
+#undef malloc
+#undef realloc
+#undef calloc
+#undef free
+#undef aligned_alloc
+#undef posix_memalign
+#undef memalign
+#undef malloc_usable_size
+#undef free_sized
+
+// Get the size of a page of memory
+size_t preload_page_size(void) {
+  return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+CUSTOM_MALLOC_API void *malloc(size_t size) {
+  void *p = custom_malloc(size);
+  if (p == NULL) {
+    errno = ENOMEM;
+  }
+  return p;
+}
+
+CUSTOM_MALLOC_API void free(void *ptr) {
+  custom_free(ptr);
+}
+
+CUSTOM_MALLOC_API void free_sized(void *ptr, size_t size) {
+  custom_free_sized(ptr, size);
+}
+
+// The allocator returns NULL for empty arrays, but programs expect the C library's behavior of
+// getting a pointer that can be freed, so those get the smallest allocation instead
+CUSTOM_MALLOC_API void *calloc(size_t nmemb, size_t size) {
+  if (nmemb == 0 || size == 0) {
+    nmemb = 1;
+    size = 1;
+  }
+  void *p = custom_calloc(nmemb, size);
+  if (p == NULL) {
+    errno = ENOMEM;
+  }
+  return p;
+}
+
+CUSTOM_MALLOC_API void *realloc(void *ptr, size_t size) {
+  void *p = custom_realloc(ptr, size);
+  if (p == NULL && size != 0) {
+    errno = ENOMEM;
+  }
+  return p;
+}
+
+// The C library's reallocarray calls its own realloc directly, so it has to be replaced too
+CUSTOM_MALLOC_API void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+  if (nmemb != 0 && size > SIZE_MAX / nmemb) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return realloc(ptr, nmemb * size);
+}
+
+// The alignment is checked here so that errno doesn't depend on whatever an earlier call left in it
+CUSTOM_MALLOC_API void *aligned_alloc(size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  void *p = custom_aligned_alloc(alignment, size);
+  if (p == NULL) {
+    errno = ENOMEM;
+  }
+  return p;
+}
+
+CUSTOM_MALLOC_API int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  return custom_posix_memalign(memptr, alignment, size);
+}
+
+// The C library's memalign rounds alignments that aren't a power of two up to the next one
+CUSTOM_MALLOC_API void *memalign(size_t alignment, size_t size) {
+  size_t power = sizeof(void *);
+  while (power < alignment) {
+    if (power > SIZE_MAX / 2) {
+      errno = EINVAL;
+      return NULL;
+    }
+    power *= 2;
+  }
+  return aligned_alloc(power, size);
+}
+
+CUSTOM_MALLOC_API void *valloc(size_t size) {
+  return aligned_alloc(preload_page_size(), size);
+}
+
+// Like valloc, but the size is also rounded up to a whole number of pages
+CUSTOM_MALLOC_API void *pvalloc(size_t size) {
+  size_t page = preload_page_size();
+  if (size > SIZE_MAX - page) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return aligned_alloc(page, (size + page - 1) & ~(page - 1));
+}
+
+CUSTOM_MALLOC_API size_t malloc_usable_size(void *ptr) {
+  return custom_malloc_usable_size(ptr);
+}
+
+// glibc's settings like M_MMAP_THRESHOLD have the same numbers as the allocator's, and the ones
+// that it doesn't have fail like any other unknown setting
+CUSTOM_MALLOC_API int mallopt(int param, int value) {
+  return custom_mallopt(param, value);
+}
+
+CUSTOM_MALLOC_API void malloc_stats(void) {
+  custom_malloc_stats();
+}
@@ -0,0 +1,81 @@
+// Checks that every allocation is aligned like it should be, and that bad alignments fail with
+// EINVAL without touching anything
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+#include "malloc.h"
+
+int failures = 0;
+
+// Check that p is a usable allocation of size bytes aligned to alignment, then free it
+void check(const char *call, void *p, size_t alignment, size_t size) {
+  if (p == NULL || ((uintptr_t) p & (alignment - 1)) != 0) {
+    fprintf(stderr, "aligned: %s of %zu bytes aligned to %zu gave %p\n", call, size, alignment, p);
+    failures++;
+    return;
+  }
+  memset(p, 0xA5, size);
+  if (custom_malloc_usable_size(p) < size) {
+    fprintf(stderr, "aligned: %s of %zu bytes aligned to %zu only has room for %zu\n", call, size,
+        alignment, custom_malloc_usable_size(p));
+    failures++;
+  }
+  custom_free(p);
+}
+
+int main(void) {
+  // Sizes around the slab, thread cache and mmap cutoffs
+  const size_t sizes[] = {1, 8, 16, 24, 100, 256, 257, 512, 513, 4000, 65536, 200000};
+  const size_t num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+  for (size_t i = 0; i < num_sizes; i++) {
+    check("malloc", custom_malloc(sizes[i]), _Alignof(max_align_t), sizes[i]);
+    check("calloc", custom_calloc(1, sizes[i]), _Alignof(max_align_t), sizes[i]);
+    for (size_t alignment = 1; alignment <= ((size_t) 1 << 20); alignment *= 2) {
+      check("aligned_alloc", custom_aligned_alloc(alignment, sizes[i]), alignment, sizes[i]);
+      check("memalign", custom_memalign(alignment, sizes[i]), alignment, sizes[i]);
+      if (alignment >= sizeof(void *)) {
+        void *p = NULL;
+        int res = custom_posix_memalign(&p, alignment, sizes[i]);
+        check("posix_memalign", res == 0 ? p : NULL, alignment, sizes[i]);
+      }
+    }
+  }
+
+  // Alignments that aren't a power of two, or for posix_memalign a multiple of a pointer's size
+  const size_t bad[] = {0, 3, 24, 48, 100, SIZE_MAX};
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    errno = 0;
+    void *p = custom_aligned_alloc(bad[i], 64);
+    if (p != NULL || errno != EINVAL) {
+      fprintf(stderr, "aligned: aligned_alloc with alignment %zu gave %p, errno %d\n", bad[i], p,
+          errno);
+      failures++;
+    }
+    errno = 0;
+    p = custom_memalign(bad[i], 64);
+    if (p != NULL || errno != EINVAL) {
+      fprintf(stderr, "aligned: memalign with alignment %zu gave %p, errno %d\n", bad[i], p, errno);
+      failures++;
+    }
+  }
+  const size_t bad_posix[] = {0, 1, 3, sizeof(void *) / 2, 24};
+  for (size_t i = 0; i < sizeof(bad_posix) / sizeof(bad_posix[0]); i++) {
+    void *p = &failures;
+    int res = custom_posix_memalign(&p, bad_posix[i], 64);
+    if (res != EINVAL || p != &failures) {
+      fprintf(stderr, "aligned: posix_memalign with alignment %zu returned %d\n", bad_posix[i],
+          res);
+      failures++;
+    }
+  }
+
+  if (failures != 0) {
+    return 1;
+  }
+  printf("aligned: ok\n");
+  return 0;
+}
@@ -0,0 +1,44 @@
+// Checks that calloc zeroes a block that is reused from the heap after being written to, both for
+// small blocks and for big ones that are zeroed with non-temporal stores
+
+#include <stdio.h>
+#include <string.h>
+
+#include "malloc.h"
+
+// Fill a heap block of size bytes, free it and check that calloc hands it back all zeros
+int check_reuse(size_t size) {
+  char *dirty = custom_malloc(size);
+  // Keeps the freed block from being merged into the unused space at the top of the heap
+  char *guard = custom_malloc(size);
+  if (dirty == NULL || guard == NULL) {
+    fprintf(stderr, "calloc_reuse: allocating %zu bytes failed\n", size);
+    return 1;
+  }
+  memset(dirty, 0xA5, size);
+  custom_free(dirty);
+  unsigned char *zeroed = custom_calloc(1, size);
+  if (zeroed != (unsigned char *) dirty) {
+    fprintf(stderr, "calloc_reuse: %zu byte block wasn't reused, got %p instead of %p\n", size,
+        (void *) zeroed, (void *) dirty);
+    return 1;
+  }
+  for (size_t i = 0; i < size; i++) {
+    if (zeroed[i] != 0) {
+      fprintf(stderr, "calloc_reuse: byte %zu of %zu isn't zero\n", i, size);
+      return 1;
+    }
+  }
+  custom_free(zeroed);
+  custom_free(guard);
+  return 0;
+}
+
+int main(void) {
+  // Past the thread caches, and past where non-temporal stores start while staying on the heap
+  if (check_reuse(4096) != 0 || check_reuse(100000) != 0) {
+    return 1;
+  }
+  printf("calloc_reuse: ok\n");
+  return 0;
+}
@@ -0,0 +1,33 @@
+// Checks that a freed block is merged with a free block right before it. Run with make test
+
+#include <stdio.h>
+
+#include "malloc.h"
+
+// Big enough to skip the thread caches and go straight back to the heap, small enough not to be
+// mapped
+#define SIZE ((size_t) 4096)
+
+int main(void) {
+  char *a = custom_malloc(SIZE);
+  char *b = custom_malloc(SIZE);
+  // Keeps b from being merged into the unused space at the top of the heap
+  char *guard = custom_malloc(SIZE);
+  if (a == NULL || b == NULL || guard == NULL || b <= a) {
+    fprintf(stderr, "coalesce: unexpected layout a=%p b=%p\n", (void *) a, (void *) b);
+    return 1;
+  }
+  custom_free(a);
+  custom_free(b);
+  // Only the block that a and b were merged into can hold both of them without growing the heap
+  char *ab = custom_malloc(2 * SIZE);
+  if (ab != a) {
+    fprintf(stderr, "coalesce: freed blocks %p and %p were not merged, got %p\n", (void *) a,
+        (void *) b, (void *) ab);
+    return 1;
+  }
+  custom_free(ab);
+  custom_free(guard);
+  printf("coalesce: ok\n");
+  return 0;
+}
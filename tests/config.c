@@ -0,0 +1,77 @@
+// Checks how CUSTOM_MALLOC_CONF strings are parsed. The parser and the settings aren't part of the
+// API, so the allocator is built into this test directly
+
+#include "malloc.c"
+
+int failures = 0;
+
+// Check that a setting has the value it should, naming what was parsed
+void expect(const char *conf, const char *name, size_t got, size_t want) {
+  if (got != want) {
+    fprintf(stderr, "config: after \"%s\", %s is %zu instead of %zu\n", conf, name, got, want);
+    failures++;
+  }
+}
+
+// Check that parse_size reads s as want, or rejects it if ok is false
+void expect_size(const char *s, bool ok, size_t want) {
+  size_t value = 0;
+  const char *end = parse_size(s, &value);
+  if (ok ? end == NULL || *end != '\0' || value != want : end != NULL) {
+    fprintf(stderr, "config: parse_size(\"%s\") gave %zu\n", s, end != NULL ? value : 0);
+    failures++;
+  }
+}
+
+#define LOAD(setting) atomic_load_explicit(&setting, memory_order_relaxed)
+
+int main(void) {
+  expect_size("12", true, 12);
+  expect_size("0x10", true, 16);
+  expect_size("4k", true, (size_t) 4 << 10);
+  expect_size("3m", true, (size_t) 3 << 20);
+  expect_size("2g", true, (size_t) 2 << 30);
+  expect_size("", false, 0);
+  expect_size("k", false, 0);
+  expect_size("-1", false, 0);
+  expect_size("99999999999999999999", false, 0);
+  expect_size("17179869184g", false, 0);
+
+  // Good values, with and without suffixes. These run before the first allocation, so the settings
+  // that can only be set up front are taken too
+  const char *good =
+      "mmap_threshold:256k,trim_threshold:1m,tcache:64,decay_time:5000,arenas:8,slab_max:128";
+  parse_config(good);
+  expect(good, "mmap_threshold", LOAD(mmap_threshold), (size_t) 256 << 10);
+  expect(good, "trim_threshold", LOAD(trim_threshold), (size_t) 1 << 20);
+  expect(good, "tcache", LOAD(tcache_max), 64);
+  expect(good, "decay_time", LOAD(decay_time), 5000);
+  expect(good, "arenas", arena_limit, 8);
+  expect(good, "slab_max", LOAD(slab_max_size), 128);
+
+  // Bad values and names are skipped without touching the setting, and don't stop the pairs after
+  // them from being applied
+  const char *bad = "tcache:100000,mmap_threshold:16,decay_time:abc,trim_threshold:12x,"
+      "huge_pages:2,bogus:1,tcache,decay_time:0x1000000000,slab_max:512,tcache:8";
+  parse_config(bad);
+  expect(bad, "mmap_threshold", LOAD(mmap_threshold), (size_t) 256 << 10);
+  expect(bad, "trim_threshold", LOAD(trim_threshold), (size_t) 1 << 20);
+  expect(bad, "decay_time", LOAD(decay_time), 5000);
+  expect(bad, "huge_pages", huge_pages, HUGE_PAGES);
+  expect(bad, "slab_max", LOAD(slab_max_size), 128);
+  expect(bad, "tcache", LOAD(tcache_max), 8);
+
+  // Once the arenas are set up, their number and huge pages can't change anymore, but the rest can
+  custom_free(custom_malloc(1));
+  const char *late = "arenas:2,huge_pages:1,mmap_threshold:1m";
+  parse_config(late);
+  expect(late, "arenas", arena_limit, 8);
+  expect(late, "huge_pages", huge_pages, HUGE_PAGES);
+  expect(late, "mmap_threshold", LOAD(mmap_threshold), (size_t) 1 << 20);
+
+  if (failures != 0) {
+    return 1;
+  }
+  printf("config: ok\n");
+  return 0;
+}
@@ -0,0 +1,46 @@
+// Helpers shared by the tests that check that the allocator stops the program
+
+#ifndef TESTS_EXPECT_H
+#define TESTS_EXPECT_H
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Run fn in a forked child and return whether it was killed by the given signal. The child's stderr
+// goes to /dev/null, so the allocator's message about what it caught doesn't clutter the output
+static inline int expect_signal(const char *test, const char *name, void (*fn)(void), int sig) {
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null != -1) {
+      dup2(null, STDERR_FILENO);
+    }
+    fn();
+    _exit(0);
+  }
+  int status;
+  if (pid == -1 || waitpid(pid, &status, 0) != pid) {
+    fprintf(stderr, "%s: %s couldn't be run\n", test, name);
+    return 0;
+  }
+  if (sig == 0 ? WIFEXITED(status) && WEXITSTATUS(status) == 0
+               : WIFSIGNALED(status) && WTERMSIG(status) == sig) {
+    return 1;
+  }
+  if (WIFSIGNALED(status)) {
+    fprintf(stderr, "%s: %s was killed by %s, expected %s\n", test, name,
+        strsignal(WTERMSIG(status)), sig == 0 ? "a clean exit" : strsignal(sig));
+  } else {
+    fprintf(stderr, "%s: %s exited with %d, expected %s\n", test, name, WEXITSTATUS(status),
+        sig == 0 ? "a clean exit" : strsignal(sig));
+  }
+  return 0;
+}
+
+#endif /* ifndef TESTS_EXPECT_H */
@@ -0,0 +1,120 @@
+// Checks that a child forked while other threads hold thread caches, or are in the middle of
+// allocating, can allocate, free and start threads of its own without deadlocking or crashing
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "malloc.h"
+#include "tests/expect.h"
+
+#define THREADS 4
+#define OBJECTS 256
+#define ROUNDS 20
+
+static const size_t sizes[] = {16, 48, 200, 1000, 5000, 40000, 300000};
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static pthread_barrier_t parked;
+static pthread_barrier_t resume;
+static atomic_bool stop;
+
+// Allocate and free every size, keeping half of the objects until the end so that the heap isn't
+// empty, and check that what was written is still there
+static int churn(unsigned int seed) {
+  void *objects[OBJECTS];
+  for (size_t i = 0; i < OBJECTS; i++) {
+    size_t size = sizes[(i + seed) % NUM_SIZES];
+    objects[i] = custom_malloc(size);
+    if (objects[i] == NULL) {
+      return 0;
+    }
+    memset(objects[i], (int) (i & 0xFF), size < 64 ? size : 64);
+  }
+  for (size_t i = 0; i < OBJECTS; i += 2) {
+    custom_free(objects[i]);
+  }
+  int ok = 1;
+  for (size_t i = 1; i < OBJECTS; i += 2) {
+    unsigned char *p = objects[i];
+    if (p[0] != (unsigned char) (i & 0xFF)) {
+      ok = 0;
+    }
+    custom_free(p);
+  }
+  return ok;
+}
+
+// Fill the thread's caches and hold on to a few objects while the main thread forks, then keep
+// allocating while it forks again
+static void *worker(void *arg) {
+  unsigned int seed = (unsigned int) (uintptr_t) arg;
+  void *held[NUM_SIZES];
+  churn(seed);
+  for (size_t i = 0; i < NUM_SIZES; i++) {
+    held[i] = custom_malloc(sizes[i]);
+  }
+  pthread_barrier_wait(&parked);
+  pthread_barrier_wait(&resume);
+  while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+    churn(seed++);
+  }
+  for (size_t i = 0; i < NUM_SIZES; i++) {
+    custom_free(held[i]);
+  }
+  return NULL;
+}
+
+static void *child_worker(void *arg) {
+  return churn((unsigned int) (uintptr_t) arg) ? NULL : arg;
+}
+
+// Runs in the child, which only has the thread that forked. A lock left held by one of the parent's
+// other threads would hang it, so it gets killed by an alarm instead
+static void use_heap(void) {
+  alarm(10);
+  for (unsigned int i = 0; i < ROUNDS; i++) {
+    if (!churn(i)) {
+      _exit(1);
+    }
+  }
+  pthread_t threads[THREADS];
+  for (size_t i = 0; i < THREADS; i++) {
+    if (pthread_create(&threads[i], NULL, child_worker, (void *) (i + 1)) != 0) {
+      _exit(1);
+    }
+  }
+  for (size_t i = 0; i < THREADS; i++) {
+    void *result;
+    pthread_join(threads[i], &result);
+    if (result != NULL) {
+      _exit(1);
+    }
+  }
+}
+
+int main(void) {
+  pthread_t threads[THREADS];
+  pthread_barrier_init(&parked, NULL, THREADS + 1);
+  pthread_barrier_init(&resume, NULL, THREADS + 1);
+  for (size_t i = 0; i < THREADS; i++) {
+    pthread_create(&threads[i], NULL, worker, (void *) (i + 1));
+  }
+  int ok = 1;
+  pthread_barrier_wait(&parked);
+  ok &= expect_signal("fork", "a fork while other threads hold caches", use_heap, 0);
+  pthread_barrier_wait(&resume);
+  for (int i = 0; i < ROUNDS; i++) {
+    ok &= expect_signal("fork", "a fork while other threads allocate", use_heap, 0);
+  }
+  atomic_store_explicit(&stop, true, memory_order_relaxed);
+  for (size_t i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  ok &= churn(0);
+  printf("fork: %s\n", ok ? "ok" : "FAILED");
+  return !ok;
+}
@@ -0,0 +1,47 @@
+// Checks what custom_free_sized does with a size that doesn't match the allocation. This is built
+// twice: with -DHARDENED it has to abort, and with -DMEM_DEBUG it has to free the object like
+// custom_free would. Both run in forked children to keep the debug output out of the way
+
+#include <stdlib.h>
+
+#include "malloc.h"
+#include "tests/expect.h"
+
+#define SIZE 32
+#define WRONG_SIZE 200
+
+char *volatile ptr;
+
+void right_size(void) {
+  ptr = custom_malloc(SIZE);
+  custom_free_sized(ptr, SIZE);
+  if (custom_malloc(SIZE) != ptr) {
+    exit(1);
+  }
+}
+
+// Afterwards the object has to be back in its own size class and not in the wrong one
+void wrong_size(void) {
+  ptr = custom_malloc(SIZE);
+  custom_free_sized(ptr, WRONG_SIZE);
+  if (custom_malloc(WRONG_SIZE) == ptr || custom_malloc(SIZE) != ptr) {
+    exit(1);
+  }
+}
+
+int main(void) {
+#ifdef HARDENED
+  const char *test = "free_sized (hardened)";
+  int wrong_size_signal = SIGABRT;
+#else
+  const char *test = "free_sized (debug)";
+  int wrong_size_signal = 0;
+#endif
+  int ok = expect_signal(test, "right size", right_size, 0) &
+      expect_signal(test, "wrong size", wrong_size, wrong_size_signal);
+  if (!ok) {
+    return 1;
+  }
+  printf("%s: ok\n", test);
+  return 0;
+}
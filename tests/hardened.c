@@ -0,0 +1,106 @@
+// Checks that a build with -DHARDENED stops the program when the heap is misused, instead of
+// carrying on. Each kind of misuse runs in a child process that has to die from it
+
+#include <stdint.h>
+#include <string.h>
+
+#include "malloc.h"
+#include "tests/expect.h"
+
+// Sizes that come from a slab, from the heap through the thread cache, from the heap directly and
+// from a mapping of their own
+#define SLAB_SIZE 32
+#define CACHED_SIZE 300
+#define HEAP_SIZE 4096
+#define MAPPED_SIZE 200000
+
+// Pointers that are freed twice or overwritten on purpose are kept here so that the compiler can't
+// see what happens to them
+char *volatile ptr;
+
+void valid_use(void) {
+  const size_t sizes[] = {SLAB_SIZE, CACHED_SIZE, HEAP_SIZE, MAPPED_SIZE};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    ptr = custom_malloc(sizes[i]);
+    memset(ptr, 1, sizes[i]);
+    ptr = custom_realloc(ptr, sizes[i] * 2);
+    custom_free(ptr);
+  }
+}
+
+void double_free_slab(void) {
+  ptr = custom_malloc(SLAB_SIZE);
+  custom_free(ptr);
+  custom_free(ptr);
+}
+
+void double_free_cached(void) {
+  ptr = custom_malloc(CACHED_SIZE);
+  custom_free(ptr);
+  custom_free(ptr);
+}
+
+void double_free_heap(void) {
+  ptr = custom_malloc(HEAP_SIZE);
+  char *guard = custom_malloc(HEAP_SIZE);
+  custom_free(ptr);
+  custom_free(ptr);
+  custom_free(guard);
+}
+
+// The mapping is gone after the first free, so reading its header faults
+void double_free_mapped(void) {
+  ptr = custom_malloc(MAPPED_SIZE);
+  custom_free(ptr);
+  custom_free(ptr);
+}
+
+void free_interior_pointer(void) {
+  ptr = custom_malloc(HEAP_SIZE);
+  custom_free(ptr + 64);
+}
+
+// An overflow out of the block before runs into the header
+void corrupted_header(void) {
+  char *before = custom_malloc(HEAP_SIZE);
+  ptr = custom_malloc(HEAP_SIZE);
+  memset(before + HEAP_SIZE, 0x41, (size_t) (ptr - before) - HEAP_SIZE);
+  custom_free(ptr);
+}
+
+// A write after free to a cached object's link. Flipping its lowest bit leaves the link misaligned
+// once it is unmangled, whatever the secret is
+void corrupted_free_list(void) {
+  char *first = custom_malloc(SLAB_SIZE);
+  ptr = custom_malloc(SLAB_SIZE);
+  custom_free(first);
+  custom_free(ptr);
+  *(uintptr_t *) ptr ^= 1;
+  ptr = custom_malloc(SLAB_SIZE);
+  ptr = custom_malloc(SLAB_SIZE);
+}
+
+// Running off the end of a mapped block reaches its guard page
+void mapped_overflow(void) {
+  ptr = custom_malloc(MAPPED_SIZE);
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  uintptr_t end = ((uintptr_t) ptr + custom_malloc_usable_size(ptr) + page - 1) & ~(page - 1);
+  *(volatile char *) end = 1;
+}
+
+int main(void) {
+  int ok = expect_signal("hardened", "valid use", valid_use, 0) &
+      expect_signal("hardened", "slab double free", double_free_slab, SIGABRT) &
+      expect_signal("hardened", "cached double free", double_free_cached, SIGABRT) &
+      expect_signal("hardened", "heap double free", double_free_heap, SIGABRT) &
+      expect_signal("hardened", "mapped double free", double_free_mapped, SIGSEGV) &
+      expect_signal("hardened", "interior pointer free", free_interior_pointer, SIGABRT) &
+      expect_signal("hardened", "corrupted header", corrupted_header, SIGABRT) &
+      expect_signal("hardened", "corrupted free list", corrupted_free_list, SIGABRT) &
+      expect_signal("hardened", "mapped overflow", mapped_overflow, SIGSEGV);
+  if (!ok) {
+    return 1;
+  }
+  printf("hardened: ok\n");
+  return 0;
+}
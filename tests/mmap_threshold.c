@@ -0,0 +1,55 @@
+// Checks that freeing a mapped block raises the mmap threshold so that blocks of its size come
+// from the heap afterwards, and that a threshold set by hand stays where it was put
+
+#include <stdio.h>
+
+#include "malloc.h"
+
+// Above the default threshold of 128 KiB
+#define SIZE ((size_t) 256 << 10)
+#define BIG_SIZE ((size_t) 1 << 20)
+
+static size_t mmap_calls(void) {
+  return custom_mallinfo().mmap_calls;
+}
+
+int main(void) {
+  // The first one is mapped and raises the threshold when it is freed
+  void *first = custom_malloc(SIZE);
+  if (first == NULL || custom_mallinfo().mmapped == 0) {
+    fprintf(stderr, "mmap_threshold: the first %zu byte block wasn't mapped\n", SIZE);
+    return 1;
+  }
+  custom_free(first);
+  // The next ones come from the heap, and the heap has room for them after the first
+  void *second = custom_malloc(SIZE);
+  custom_free(second);
+  size_t calls = mmap_calls();
+  for (int i = 0; i < 100; i++) {
+    void *p = custom_malloc(SIZE);
+    if (p == NULL || custom_mallinfo().mmapped != 0) {
+      fprintf(stderr, "mmap_threshold: a %zu byte block was mapped after one was freed\n", SIZE);
+      return 1;
+    }
+    custom_free(p);
+  }
+  if (mmap_calls() != calls) {
+    fprintf(stderr, "mmap_threshold: %zu mappings for blocks that should be reused\n",
+        mmap_calls() - calls);
+    return 1;
+  }
+  // Once the threshold is set it doesn't move anymore
+  if (custom_mallopt(CUSTOM_M_MMAP_THRESHOLD, 128 << 10) != 1) {
+    fprintf(stderr, "mmap_threshold: couldn't set the threshold\n");
+    return 1;
+  }
+  custom_free(custom_malloc(BIG_SIZE));
+  void *big = custom_malloc(BIG_SIZE);
+  if (big == NULL || custom_mallinfo().mmapped == 0) {
+    fprintf(stderr, "mmap_threshold: the threshold moved after it was set\n");
+    return 1;
+  }
+  custom_free(big);
+  printf("mmap_threshold: ok\n");
+  return 0;
+}
@@ -0,0 +1,59 @@
+// Checks the errno that the preload library's functions fail with. This is built against the C
+// library's names and run with LD_PRELOAD=./libcustommalloc_preload.so by make test
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <malloc.h>
+
+int failures = 0;
+
+// Sizes that can't be allocated, hidden from the compiler so that it doesn't warn about them
+volatile size_t huge = SIZE_MAX;
+volatile size_t almost_huge = SIZE_MAX - 4096;
+
+// Check that p is NULL and that errno is want, naming the call that was made
+void expect_errno(const char *call, void *p, int want) {
+  if (p != NULL || errno != want) {
+    fprintf(stderr, "preload_errno: %s returned %p with errno %d, expected NULL with errno %d\n",
+        call, p, errno, want);
+    failures++;
+  }
+}
+
+int main(void) {
+  if (dlsym(RTLD_DEFAULT, "custom_malloc") == NULL) {
+    fprintf(stderr, "preload_errno: run with LD_PRELOAD=./libcustommalloc_preload.so\n");
+    return 1;
+  }
+  // A failed allocation is ENOMEM no matter what errno held before the call
+  errno = EINVAL;
+  expect_errno("aligned_alloc(64, SIZE_MAX - 4096)", aligned_alloc(64, almost_huge), ENOMEM);
+  errno = EINVAL;
+  expect_errno("malloc(SIZE_MAX)", malloc(huge), ENOMEM);
+  errno = EINVAL;
+  expect_errno("calloc(SIZE_MAX, 2)", calloc(huge, 2), ENOMEM);
+  errno = EINVAL;
+  void *p = malloc(16);
+  void *r = realloc(p, huge);
+  expect_errno("realloc(p, SIZE_MAX)", r, ENOMEM);
+  free(r != NULL ? r : p);
+  // Only a bad alignment is EINVAL
+  errno = 0;
+  expect_errno("aligned_alloc(24, 64)", aligned_alloc(24, 64), EINVAL);
+  errno = 0;
+  expect_errno("aligned_alloc(0, 64)", aligned_alloc(0, 64), EINVAL);
+  void *q = NULL;
+  if (posix_memalign(&q, 24, 64) != EINVAL || posix_memalign(&q, 64, almost_huge) != ENOMEM) {
+    fprintf(stderr, "preload_errno: posix_memalign returned the wrong error\n");
+    failures++;
+  }
+  if (failures != 0) {
+    return 1;
+  }
+  printf("preload_errno: ok\n");
+  return 0;
+}